@@ -0,0 +1,219 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "admission.h"
+
+/* Slots are single bytes of the admission file, held with open file
+ * description locks.  The kernel drops those when the last descriptor
+ * goes away, so a crashed or killed invocation can never leak a slot.
+ * Sandbox slots start at 0 and mount slots at MOUNT_SLOTS_OFFSET, so
+ * invocations using different limits on the same file still agree.
+ */
+#define MOUNT_SLOTS_OFFSET ((off_t) 1 << 32)
+#define MAX_SANDBOX_SLOTS MOUNT_SLOTS_OFFSET
+
+#define MIN_BACKOFF_NSEC (5 * 1000 * 1000)
+#define MAX_BACKOFF_NSEC (200 * 1000 * 1000)
+
+static int
+set_lock (int   fd,
+          int   cmd,
+          short type,
+          off_t start,
+          off_t len)
+{
+  struct flock fl;
+
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+  return fcntl (fd, cmd, &fl);
+}
+
+/* Lock @need free bytes between @base and @base + @limit.  Each
+ * attempt first tries to take all remaining bytes in one range, which
+ * succeeds right away when the file isn't crowded; otherwise the byte
+ * at the current position is probed on its own and skipped if held.
+ * F_OFD_GETLK could tell us about some lock in the way, but not
+ * necessarily the first one, so it can't be used to skip ahead.
+ * Returns 1 if locked, 0 if there wasn't room, -1 on error.
+ */
+static int
+lock_slots (int   fd,
+            off_t base,
+            off_t limit,
+            off_t need)
+{
+  off_t end = base + limit;
+  off_t pos = base;
+  off_t got = 0;
+
+  while (got < need && end - pos >= need - got)
+    {
+      if (set_lock (fd, F_OFD_SETLK, F_WRLCK, pos, need - got) == 0)
+        {
+          got = need;
+          break;
+        }
+      if (errno != EAGAIN && errno != EACCES)
+        return -1;
+
+      if (set_lock (fd, F_OFD_SETLK, F_WRLCK, pos, 1) == 0)
+        got++;
+      else if (errno != EAGAIN && errno != EACCES)
+        return -1;
+      pos++;
+    }
+
+  if (got >= need)
+    return 1;
+
+  (void) set_lock (fd, F_OFD_SETLK, F_UNLCK, base, limit);
+  return 0;
+}
+
+/* Returns the larger of the "some avg10" figures for memory and IO,
+ * or 0 if the kernel doesn't have PSI.
+ */
+static double
+current_pressure (void)
+{
+  static const char *const files[] = { "/proc/pressure/memory", "/proc/pressure/io" };
+  double worst = 0;
+  unsigned int i;
+
+  for (i = 0; i < sizeof (files) / sizeof (files[0]); i++)
+    {
+      FILE *f = fopen (files[i], "re");
+      double avg10;
+
+      if (f == NULL)
+        continue;
+      if (fscanf (f, "some avg10=%lf", &avg10) == 1 && avg10 > worst)
+        worst = avg10;
+      fclose (f);
+    }
+
+  return worst;
+}
+
+static int
+try_admit (int                    fd,
+           const AdmissionLimits *limits,
+           unsigned int           n_mounts)
+{
+  int r;
+
+  if (limits->max_pressure >= 0 && current_pressure () > limits->max_pressure)
+    return 0;
+
+  if (fd == -1)
+    return 1;
+
+  if (limits->max_sandboxes > 0)
+    {
+      r = lock_slots (fd, 0, limits->max_sandboxes, 1);
+      if (r <= 0)
+        return r;
+    }
+
+  if (limits->max_mounts > 0 && n_mounts > 0)
+    {
+      r = lock_slots (fd, MOUNT_SLOTS_OFFSET, limits->max_mounts, n_mounts);
+      if (r <= 0)
+        {
+          int errsv = errno;
+          (void) set_lock (fd, F_OFD_SETLK, F_UNLCK, 0, MAX_SANDBOX_SLOTS);
+          errno = errsv;
+          return r;
+        }
+    }
+
+  return 1;
+}
+
+/**
+ * admission_acquire:
+ * @fd: Admission file opened read-write, or -1 to only check pressure
+ * @limits: Limits to apply
+ * @n_mounts: Number of mounts this container will make
+ *
+ * Wait until starting a container with @n_mounts mounts fits within
+ * @limits, then take its slots.  They are held for as long as @fd (or
+ * any duplicate of it) stays open.  Waiting backs off up to 200ms
+ * between attempts; after @limits->timeout_sec we give up with
+ * ETIMEDOUT.
+ */
+int
+admission_acquire (int                    fd,
+                   const AdmissionLimits *limits,
+                   unsigned int           n_mounts)
+{
+  struct timespec now, deadline;
+  long backoff = MIN_BACKOFF_NSEC;
+
+  if (limits->max_mounts > 0 && n_mounts > limits->max_mounts)
+    {
+      errno = E2BIG;
+      return -1;
+    }
+
+  (void) clock_gettime (CLOCK_MONOTONIC, &deadline);
+  srandom (getpid () ^ deadline.tv_nsec);
+  deadline.tv_sec += limits->timeout_sec;
+
+  for (;;)
+    {
+      struct timespec delay;
+      int r = try_admit (fd, limits, n_mounts);
+
+      if (r < 0)
+        return -1;
+      if (r > 0)
+        return 0;
+
+      (void) clock_gettime (CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > deadline.tv_sec
+          || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        {
+          errno = ETIMEDOUT;
+          return -1;
+        }
+
+      /* Jitter, so a crowd of waiters doesn't retry in lockstep */
+      delay.tv_sec = 0;
+      delay.tv_nsec = backoff / 2 + random () % (backoff / 2);
+      (void) nanosleep (&delay, NULL);
+      if (backoff < MAX_BACKOFF_NSEC)
+        backoff *= 2;
+    }
+}
@@ -0,0 +1,36 @@
+/* -*- mode: c; tab-width: 2; indent-tabs-mode: nil -*-
+ *
+ * linux-user-chroot: A setuid program that allows non-root users to safely chroot(2)
+ *
+ * Copyright 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#pragma once
+
+typedef struct _AdmissionLimits AdmissionLimits;
+struct _AdmissionLimits {
+  /* Zero means unlimited */
+  unsigned int max_sandboxes;
+  unsigned int max_mounts;
+  /* Percentage of time stalled over the last 10s; negative disables */
+  double max_pressure;
+  unsigned int timeout_sec;
+};
+
+int admission_acquire (int                    fd,
+                       const AdmissionLimits *limits,
+                       unsigned int           n_mounts);
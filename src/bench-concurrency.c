@@ -0,0 +1,376 @@
+/* -*- mode: c; tab-width: 2; indent-tabs-mode: nil -*-
+ *
+ * bench-concurrency: Measure how linux-user-chroot scales when many
+ * containers are started at once
+ *
+ * The expensive parts of container setup (clone() with new
+ * namespaces, mount(), namespace teardown) take kernel-wide locks, so
+ * the time for one invocation says little about a build host running
+ * dozens of them.  This starts N copies in parallel for increasing N
+ * and reports throughput and latency at each step.
+ *
+ * With --startup it instead runs "LINUX_USER_CHROOT --version" one at
+ * a time, which is just exec and process startup; compare a build
+ * configured with --enable-static-binary against one without.
+ *
+ * Copyright 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* Doubling N must gain at least this much throughput to count as scaling */
+#define SCALING_THRESHOLD 1.10
+
+/* Upper bounds for the numeric options, well past any useful run */
+#define MAX_JOBS 4096
+#define MAX_ITERATIONS 1000000
+#define MAX_MOUNTS 1024
+
+static void fatal (const char *message, ...) __attribute__ ((noreturn)) __attribute__ ((format (printf, 1, 2)));
+static void fatal_errno (const char *message) __attribute__ ((noreturn));
+static void usage (const char *argv0) __attribute__ ((noreturn));
+
+static void
+fatal (const char *fmt,
+       ...)
+{
+  va_list args;
+  
+  va_start (args, fmt);
+
+  vfprintf (stderr, fmt, args);
+  putc ('\n', stderr);
+  
+  va_end (args);
+  exit (1);
+}
+
+static void
+fatal_errno (const char *message)
+{
+  perror (message);
+  exit (1);
+}
+
+static void
+usage (const char *argv0)
+{
+  fatal ("usage: %s [--max-jobs N] [--iterations N] [--mounts N] [--rootdir DIR] "
+         "[--seccomp] [--unshare-ipc] [--unshare-pid] [--unshare-net] [--startup] LINUX_USER_CHROOT", argv0);
+}
+
+/* Parse a decimal count no larger than @max, or show the usage */
+static unsigned int
+parse_count (const char   *argv0,
+             const char   *arg,
+             unsigned int  max)
+{
+  unsigned long value;
+  char *end;
+
+  errno = 0;
+  value = strtoul (arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || value > max)
+    usage (argv0);
+  return value;
+}
+
+static uint64_t
+now_usec (void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+uint64_compare (const void *a,
+                const void *b)
+{
+  uint64_t ua = *(const uint64_t *) a;
+  uint64_t ub = *(const uint64_t *) b;
+  return (ua > ub) - (ua < ub);
+}
+
+/* Run @iterations containers one after the other, recording each
+ * one's latency; this is the body of each of the N workers.
+ */
+static void
+run_worker (char        **child_argv,
+            unsigned int  iterations,
+            uint64_t     *latencies,
+            int           start_fd)
+{
+  posix_spawn_file_actions_t actions;
+  unsigned int i;
+  char c;
+
+  /* Keep --version quiet */
+  if (posix_spawn_file_actions_init (&actions) != 0
+      || posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0) != 0)
+    _exit (1);
+
+  /* Wait until the parent releases every worker at once */
+  while (read (start_fd, &c, 1) < 0 && errno == EINTR)
+    ;
+
+  for (i = 0; i < iterations; i++)
+    {
+      uint64_t start = now_usec ();
+      int status;
+      pid_t pid;
+
+      if (posix_spawn (&pid, child_argv[0], &actions, NULL, child_argv, environ) != 0)
+        _exit (1);
+      if (waitpid (pid, &status, 0) < 0)
+        _exit (1);
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+        _exit (1);
+      latencies[i] = now_usec () - start;
+    }
+
+  _exit (0);
+}
+
+/* Returns containers per second */
+static double
+run_step (char         **child_argv,
+          unsigned int   n_jobs,
+          unsigned int   iterations)
+{
+  uint64_t *latencies;
+  size_t n_samples = (size_t) n_jobs * iterations;
+  size_t size = n_samples * sizeof (uint64_t);
+  int start_pipe[2];
+  uint64_t start, elapsed;
+  unsigned int i;
+  int failed = 0;
+  double rate;
+
+  latencies = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (latencies == MAP_FAILED)
+    fatal_errno ("mmap");
+  if (pipe2 (start_pipe, O_CLOEXEC) < 0)
+    fatal_errno ("pipe2");
+
+  for (i = 0; i < n_jobs; i++)
+    {
+      pid_t pid = fork ();
+      if (pid < 0)
+        fatal_errno ("fork");
+      if (pid == 0)
+        {
+          (void) close (start_pipe[1]);
+          run_worker (child_argv, iterations, latencies + (size_t) i * iterations, start_pipe[0]);
+        }
+    }
+
+  (void) close (start_pipe[0]);
+  start = now_usec ();
+  (void) close (start_pipe[1]);
+
+  for (i = 0; i < n_jobs; i++)
+    {
+      int status;
+      if (wait (&status) < 0)
+        fatal_errno ("wait");
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+        failed = 1;
+    }
+  elapsed = now_usec () - start;
+
+  if (failed)
+    fatal ("A container failed at %u jobs; run the command by hand to see why", n_jobs);
+
+  qsort (latencies, n_samples, sizeof (uint64_t), uint64_compare);
+  rate = n_samples * 1e6 / (elapsed ? elapsed : 1);
+
+  printf ("%6u %12.1f %10.2f %10.2f %10.2f %10.2f\n",
+          n_jobs, rate,
+          latencies[n_samples / 2] / 1000.0,
+          latencies[(n_samples * 99) / 100] / 1000.0,
+          latencies[(n_samples * 999) / 1000] / 1000.0,
+          latencies[n_samples - 1] / 1000.0);
+  fflush (stdout);
+
+  (void) munmap (latencies, size);
+  return rate;
+}
+
+int
+main (int      argc,
+      char   **argv)
+{
+  const char *argv0 = argv[0];
+  long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  unsigned int max_jobs = 0;
+  unsigned int iterations = 50;
+  unsigned int n_mounts = 0;
+  int startup = 0;
+  int seccomp = 0;
+  unsigned int n_jobs;
+  const char *rootdir = "/";
+  const char *extra_args[5]; /* The --unshare-* options, and two for --seccomp */
+  unsigned int n_extra_args = 0;
+  char **child_argv;
+  unsigned int n_child_argv = 0;
+  unsigned int flattened_at = 0;
+  unsigned int prev_jobs = 0;
+  double prev_rate = 0;
+  unsigned int i;
+
+  argc--;
+  argv++;
+
+  while (argc > 0 && strncmp (argv[0], "--", 2) == 0)
+    {
+      const char *arg = argv[0];
+
+      if (strcmp (arg, "--max-jobs") == 0 && argc > 1)
+        {
+          max_jobs = parse_count (argv0, argv[1], MAX_JOBS);
+          argc -= 2; argv += 2;
+        }
+      else if (strcmp (arg, "--iterations") == 0 && argc > 1)
+        {
+          iterations = parse_count (argv0, argv[1], MAX_ITERATIONS);
+          argc -= 2; argv += 2;
+        }
+      else if (strcmp (arg, "--mounts") == 0 && argc > 1)
+        {
+          n_mounts = parse_count (argv0, argv[1], MAX_MOUNTS);
+          argc -= 2; argv += 2;
+        }
+      else if (strcmp (arg, "--rootdir") == 0 && argc > 1)
+        {
+          rootdir = argv[1];
+          argc -= 2; argv += 2;
+        }
+      else if (strcmp (arg, "--startup") == 0)
+        {
+          startup = 1;
+          argc--; argv++;
+        }
+      else if (strcmp (arg, "--seccomp") == 0)
+        {
+          seccomp = 1;
+          argc--; argv++;
+        }
+      else if (strcmp (arg, "--unshare-ipc") == 0
+               || strcmp (arg, "--unshare-pid") == 0
+               || strcmp (arg, "--unshare-net") == 0)
+        {
+          /* Ignore repeats rather than overflowing extra_args */
+          unsigned int j;
+          for (j = 0; j < n_extra_args; j++)
+            if (strcmp (extra_args[j], arg) == 0)
+              break;
+          if (j == n_extra_args)
+            extra_args[n_extra_args++] = arg;
+          argc--; argv++;
+        }
+      else
+        break;
+    }
+
+  if (argc != 1 || iterations == 0)
+    usage (argv0);
+
+  if (seccomp)
+    {
+      extra_args[n_extra_args++] = "--seccomp-profile-version";
+      extra_args[n_extra_args++] = "0";
+    }
+
+  if (startup)
+    max_jobs = 1;
+  if (max_jobs == 0)
+    max_jobs = 4 * (n_cpus > 0 ? n_cpus : 1);
+
+  /* Each mount is a procfs at /proc; mounting it repeatedly still
+   * exercises the full mount path, and /proc exists in any usable root.
+   */
+  child_argv = calloc (1 + n_extra_args + 2 * n_mounts + 3, sizeof (char *));
+  if (!child_argv)
+    fatal ("Out of memory");
+  child_argv[n_child_argv++] = argv[0];
+  if (startup)
+    {
+      child_argv[n_child_argv++] = "--version";
+      n_extra_args = n_mounts = 0;
+    }
+  for (i = 0; i < n_extra_args; i++)
+    child_argv[n_child_argv++] = (char *) extra_args[i];
+  for (i = 0; i < n_mounts; i++)
+    {
+      child_argv[n_child_argv++] = "--mount-proc";
+      child_argv[n_child_argv++] = "/proc";
+    }
+  if (!startup)
+    {
+      child_argv[n_child_argv++] = (char *) rootdir;
+      child_argv[n_child_argv++] = "/bin/true";
+    }
+  child_argv[n_child_argv] = NULL;
+
+  printf ("# %u iterations per job, %u mounts, %ld cpus\n", iterations, n_mounts, n_cpus);
+  printf ("%6s %12s %10s %10s %10s %10s\n", "jobs", "containers/s", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+
+  for (n_jobs = 1; ; n_jobs = (n_jobs * 2 > max_jobs && n_jobs < max_jobs) ? max_jobs : n_jobs * 2)
+    {
+      double rate = run_step (child_argv, n_jobs, iterations);
+
+      /* Report the step after which throughput never picked up again */
+      if (prev_rate > 0 && rate < prev_rate * SCALING_THRESHOLD)
+        {
+          if (flattened_at == 0)
+            flattened_at = prev_jobs;
+        }
+      else
+        flattened_at = 0;
+      prev_rate = rate;
+      prev_jobs = n_jobs;
+
+      if (n_jobs >= max_jobs)
+        break;
+    }
+
+  if (flattened_at)
+    printf ("# scaling flattens at %u jobs\n", flattened_at);
+  else if (max_jobs > 1)
+    printf ("# still scaling at %u jobs\n", max_jobs);
+
+  return 0;
+}
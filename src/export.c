@@ -0,0 +1,245 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+
+#include "export.h"
+#include "cleanup.h"
+
+/* Copy the contents of @src_fd to @dest_fd, sharing extents if the
+ * filesystem can (btrfs, xfs, ...), else letting the kernel copy
+ * (which may still be offloaded, e.g. for NFS), else by hand.
+ */
+static int
+copy_data (int src_fd,
+           int dest_fd)
+{
+  char buf[64 * 1024];
+  ssize_t n;
+
+  if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+    return 0;
+
+  /* copy_file_range() advances both offsets, so whatever it managed
+   * is not redone below. */
+  for (;;)
+    {
+      n = copy_file_range (src_fd, NULL, dest_fd, NULL, SSIZE_MAX, 0);
+      if (n == 0)
+        return 0;
+      if (n < 0)
+        {
+          if (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+              || errno == EOPNOTSUPP || errno == EBADF)
+            break;
+          return -1;
+        }
+    }
+
+  for (;;)
+    {
+      char *p = buf;
+
+      n = read (src_fd, buf, sizeof (buf));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return n;
+      while (n > 0)
+        {
+          ssize_t written = write (dest_fd, p, n);
+          if (written < 0 && errno == EINTR)
+            continue;
+          if (written < 0)
+            return -1;
+          p += written;
+          n -= written;
+        }
+    }
+}
+
+static int
+copy_at (int         src_dfd,
+         const char *src_name,
+         int         dest_dfd,
+         const char *dest_name)
+{
+  struct stat stbuf;
+
+  if (fstatat (src_dfd, src_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return -1;
+
+  if (S_ISDIR (stbuf.st_mode))
+    {
+      _cleanup_fd_close_ int dest_fd = -1;
+      int src_fd;
+      DIR *dir;
+      struct dirent *dent;
+      int ret = 0;
+
+      if (mkdirat (dest_dfd, dest_name, 0700) < 0 && errno != EEXIST)
+        return -1;
+      dest_fd = openat (dest_dfd, dest_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (dest_fd < 0)
+        return -1;
+      src_fd = openat (src_dfd, src_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (src_fd < 0)
+        return -1;
+      dir = fdopendir (src_fd);
+      if (dir == NULL)
+        {
+          (void) close (src_fd);
+          return -1;
+        }
+
+      while (ret == 0 && (dent = readdir (dir)) != NULL)
+        {
+          if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+            continue;
+          ret = copy_at (dirfd (dir), dent->d_name, dest_fd, dent->d_name);
+        }
+      (void) closedir (dir);
+      if (ret < 0)
+        return -1;
+
+      if (fchmod (dest_fd, stbuf.st_mode & 07777) < 0)
+        return -1;
+    }
+  else if (S_ISREG (stbuf.st_mode))
+    {
+      _cleanup_fd_close_ int src_fd = -1;
+      _cleanup_fd_close_ int dest_fd = -1;
+      struct timespec times[2];
+
+      src_fd = openat (src_dfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (src_fd < 0)
+        return -1;
+      dest_fd = openat (dest_dfd, dest_name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                        stbuf.st_mode & 0777);
+      if (dest_fd < 0)
+        return -1;
+      if (copy_data (src_fd, dest_fd) < 0)
+        return -1;
+      if (fchmod (dest_fd, stbuf.st_mode & 0777) < 0)
+        return -1;
+
+      /* Keep mtimes so that make et al. don't see the output as new */
+      times[0] = stbuf.st_atim;
+      times[1] = stbuf.st_mtim;
+      (void) futimens (dest_fd, times);
+    }
+  else if (S_ISLNK (stbuf.st_mode))
+    {
+      char target[PATH_MAX];
+      ssize_t len;
+
+      len = readlinkat (src_dfd, src_name, target, sizeof (target) - 1);
+      if (len < 0)
+        return -1;
+      target[len] = '\0';
+      (void) unlinkat (dest_dfd, dest_name, 0);
+      if (symlinkat (target, dest_dfd, dest_name) < 0)
+        return -1;
+    }
+  /* Device nodes, sockets and fifos aren't build outputs; skip them */
+
+  return 0;
+}
+
+static int
+open_in_root (int         root_fd,
+              const char *path)
+{
+  struct open_how how;
+  int fd;
+
+  memset (&how, 0, sizeof (how));
+  how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+  how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+
+  fd = syscall (__NR_openat2, root_fd, path, &how, sizeof (how));
+  if (fd >= 0 || errno != ENOSYS)
+    return fd;
+
+  /* Before 5.6 we can't stop absolute symlinks resolving on the host */
+  while (*path == '/')
+    path++;
+  return openat (root_fd, *path ? path : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * export_tree:
+ * @root_fd: Root directory of the container
+ * @path: Path to export, as seen inside @root_fd
+ * @dest: Host path to copy to
+ *
+ * Recursively copy @path out of @root_fd to @dest.  Symbolic links in
+ * @path are resolved as they would be inside @root_fd, and copied as
+ * links below it.  Existing files in @dest are overwritten.
+ */
+int
+export_tree (int         root_fd,
+             const char *path,
+             const char *dest)
+{
+  _cleanup_fd_close_ int parent_fd = -1;
+  char *parent;
+  char *slash;
+  const char *name;
+  int ret;
+
+  parent = strdup (path);
+  if (!parent)
+    return -1;
+  /* Strip trailing slashes so "/foo/" names "foo" in "/" */
+  for (slash = parent + strlen (parent); slash > parent + 1 && slash[-1] == '/'; slash--)
+    slash[-1] = '\0';
+  slash = strrchr (parent, '/');
+  if (slash == NULL || slash[1] == '\0')
+    {
+      /* Exporting the whole root, or a bare name relative to it */
+      name = slash ? "." : parent;
+      parent_fd = open_in_root (root_fd, "/");
+    }
+  else
+    {
+      *slash = '\0';
+      name = slash + 1;
+      parent_fd = open_in_root (root_fd, *parent ? parent : "/");
+    }
+
+  ret = parent_fd < 0 ? -1 : copy_at (parent_fd, name, AT_FDCWD, dest);
+  free (parent);
+  return ret;
+}
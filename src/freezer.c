@@ -0,0 +1,575 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/fsuid.h>
+
+#include "freezer.h"
+#include "setup-fds.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* How long to wait for every task in a cgroup to stop */
+#define FREEZE_TIMEOUT_MS 10000
+
+struct _Freezer {
+  /* NULL if we fall back to signals */
+  char *cgroup_path;
+  int cgroup_fd;
+  int procs_fd;
+};
+
+/* Returns the cgroup v2 path of this process, or NULL */
+static char *
+get_own_cgroup (void)
+{
+  FILE *f;
+  char *line = NULL;
+  size_t line_len = 0;
+  char *ret = NULL;
+
+  f = fopen ("/proc/self/cgroup", "re");
+  if (f == NULL)
+    return NULL;
+
+  while (getline (&line, &line_len, f) > 0)
+    {
+      if (strncmp (line, "0::/", 4) == 0)
+        {
+          line[strcspn (line, "\n")] = '\0';
+          ret = strdup (line + 3);
+          break;
+        }
+    }
+
+  free (line);
+  (void) fclose (f);
+  return ret;
+}
+
+/* Make a cgroup for the container below our own, as @uid, so that
+ * this only works if the caller has been delegated that cgroup.
+ */
+static int
+make_cgroup (Freezer *freezer,
+             uid_t    uid)
+{
+  struct statfs stfs;
+  char *own;
+  int errsv;
+  int ret = -1;
+
+  if (statfs (CGROUP_ROOT, &stfs) < 0 || stfs.f_type != CGROUP2_SUPER_MAGIC)
+    return -1;
+
+  own = get_own_cgroup ();
+  if (own == NULL)
+    return -1;
+  if (asprintf (&freezer->cgroup_path, CGROUP_ROOT "%s%slinux-user-chroot-%d",
+                own, strcmp (own, "/") == 0 ? "" : "/", (int) getpid ()) < 0)
+    {
+      freezer->cgroup_path = NULL;
+      free (own);
+      return -1;
+    }
+  free (own);
+
+  (void) setfsuid (uid);
+  if (mkdir (freezer->cgroup_path, 0755) == 0)
+    {
+      freezer->cgroup_fd = open (freezer->cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (freezer->cgroup_fd >= 0)
+        freezer->procs_fd = openat (freezer->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+      if (freezer->procs_fd >= 0)
+        ret = 0;
+      else
+        (void) rmdir (freezer->cgroup_path);
+    }
+  errsv = errno;
+  (void) setfsuid (0);
+
+  if (ret < 0)
+    {
+      if (freezer->cgroup_fd >= 0)
+        (void) close (freezer->cgroup_fd);
+      freezer->cgroup_fd = -1;
+      free (freezer->cgroup_path);
+      freezer->cgroup_path = NULL;
+    }
+  errno = errsv;
+  return ret;
+}
+
+/**
+ * freezer_new:
+ * @uid: The calling user
+ *
+ * Prepare to freeze the container.  If the cgroup we're in is a
+ * cgroup v2 one that @uid may create cgroups below, the container
+ * gets its own cgroup to use the freezer of; otherwise we'll stop
+ * its processes with signals.  Must be called as root before cloning
+ * the child.  Returns %NULL only if out of memory.
+ */
+Freezer *
+freezer_new (uid_t uid)
+{
+  Freezer *freezer;
+
+  freezer = calloc (1, sizeof (Freezer));
+  if (freezer == NULL)
+    return NULL;
+  freezer->cgroup_fd = -1;
+  freezer->procs_fd = -1;
+
+  (void) make_cgroup (freezer, uid);
+  return freezer;
+}
+
+/**
+ * freezer_enter:
+ * @freezer: A #Freezer
+ *
+ * Called by the child first thing, to move into the container's
+ * cgroup before it starts any other processes.
+ */
+int
+freezer_enter (Freezer *freezer)
+{
+  int ret = 0;
+
+  if (freezer->procs_fd == -1)
+    return 0;
+
+  if (write (freezer->procs_fd, "0", 1) != 1)
+    ret = -1;
+  (void) close (freezer->procs_fd);
+  freezer->procs_fd = -1;
+  return ret;
+}
+
+static int
+cgroup_is_frozen (int events_fd)
+{
+  char buf[512];
+  ssize_t n;
+  char *p;
+
+  n = pread (events_fd, buf, sizeof (buf) - 1, 0);
+  if (n < 0)
+    return -1;
+  buf[n] = '\0';
+
+  p = strstr (buf, "frozen ");
+  return p != NULL && p[7] == '1';
+}
+
+static int
+cgroup_set_frozen (Freezer *freezer,
+                   int      frozen)
+{
+  int fd;
+  int events_fd;
+  int waited = 0;
+  int ret = -1;
+
+  fd = openat (freezer->cgroup_fd, "cgroup.freeze", O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (write (fd, frozen ? "1" : "0", 1) != 1)
+    {
+      int errsv = errno;
+      (void) close (fd);
+      errno = errsv;
+      return -1;
+    }
+  (void) close (fd);
+
+  if (!frozen)
+    return 0;
+
+  /* Freezing is asynchronous; "frozen 1" shows up in cgroup.events
+   * once every task has stopped, with a POLLPRI notification.
+   */
+  events_fd = openat (freezer->cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+  if (events_fd < 0)
+    return -1;
+  for (;;)
+    {
+      struct pollfd pfd = { events_fd, POLLPRI, 0 };
+      int r = cgroup_is_frozen (events_fd);
+
+      if (r < 0)
+        break;
+      if (r)
+        {
+          ret = 0;
+          break;
+        }
+      if (waited >= FREEZE_TIMEOUT_MS)
+        {
+          errno = ETIMEDOUT;
+          break;
+        }
+      /* Poll in slices in case we miss a notification */
+      if (poll (&pfd, 1, 100) < 0 && errno != EINTR)
+        break;
+      waited += 100;
+    }
+  (void) close (events_fd);
+  return ret;
+}
+
+typedef struct {
+  pid_t pid;
+  pid_t ppid;
+  int in_tree;
+  int signaled;
+} ProcEntry;
+
+static int
+read_ppid (pid_t  pid,
+           pid_t *ppid)
+{
+  char path[64];
+  char buf[1024];
+  char *p;
+  int fd;
+  ssize_t n;
+  int val;
+
+  snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  n = read (fd, buf, sizeof (buf) - 1);
+  (void) close (fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+
+  /* The command name can contain anything, so skip to after it */
+  p = strrchr (buf, ')');
+  if (p == NULL || sscanf (p + 1, " %*c %d", &val) != 1)
+    return -1;
+  *ppid = val;
+  return 0;
+}
+
+/* Send @sig to @root and all its descendants.  Processes can fork
+ * while we look, so repeat until a pass finds nobody new; with
+ * SIGSTOP this converges as they stop.
+ */
+static int
+signal_tree (pid_t root,
+             int   sig)
+{
+  ProcEntry *procs = NULL;
+  size_t n_procs = 0;
+  size_t n_alloc = 0;
+  int found_new;
+  int ret = -1;
+
+  if (kill (root, sig) < 0)
+    return -1;
+
+  do
+    {
+      DIR *dir;
+      struct dirent *dent;
+      int changed;
+      size_t i;
+
+      found_new = 0;
+
+      dir = opendir ("/proc");
+      if (dir == NULL)
+        goto out;
+      while ((dent = readdir (dir)) != NULL)
+        {
+          char *end;
+          long pid = strtol (dent->d_name, &end, 10);
+          pid_t ppid;
+
+          if (*end != '\0' || pid <= 0 || pid == root)
+            continue;
+          if (read_ppid ((pid_t) pid, &ppid) < 0)
+            continue;
+
+          for (i = 0; i < n_procs; i++)
+            if (procs[i].pid == pid)
+              break;
+          if (i == n_procs)
+            {
+              if (n_procs == n_alloc)
+                {
+                  ProcEntry *new_procs;
+                  n_alloc = n_alloc ? n_alloc * 2 : 64;
+                  new_procs = realloc (procs, n_alloc * sizeof (ProcEntry));
+                  if (new_procs == NULL)
+                    {
+                      (void) closedir (dir);
+                      goto out;
+                    }
+                  procs = new_procs;
+                }
+              procs[n_procs].pid = pid;
+              procs[n_procs].in_tree = 0;
+              procs[n_procs].signaled = 0;
+              n_procs++;
+            }
+          procs[i].ppid = ppid;
+        }
+      (void) closedir (dir);
+
+      do
+        {
+          changed = 0;
+          for (i = 0; i < n_procs; i++)
+            {
+              size_t j;
+
+              if (procs[i].in_tree)
+                continue;
+              if (procs[i].ppid == root)
+                procs[i].in_tree = 1;
+              for (j = 0; j < n_procs && !procs[i].in_tree; j++)
+                if (procs[j].in_tree && procs[j].pid == procs[i].ppid)
+                  procs[i].in_tree = 1;
+              changed |= procs[i].in_tree;
+            }
+        }
+      while (changed);
+
+      for (i = 0; i < n_procs; i++)
+        {
+          if (procs[i].in_tree && !procs[i].signaled)
+            {
+              /* It may have exited meanwhile */
+              if (kill (procs[i].pid, sig) < 0 && errno != ESRCH)
+                goto out;
+              procs[i].signaled = 1;
+              found_new = 1;
+            }
+        }
+    }
+  while (found_new);
+
+  ret = 0;
+ out:
+  free (procs);
+  return ret;
+}
+
+static int
+set_frozen (Freezer *freezer,
+            pid_t    child,
+            int      frozen)
+{
+  if (freezer->cgroup_path)
+    return cgroup_set_frozen (freezer, frozen);
+  return signal_tree (child, frozen ? SIGSTOP : SIGCONT);
+}
+
+static void
+reply (int         fd,
+       const char *msg)
+{
+  size_t len = strlen (msg);
+
+  /* The caller went away; nothing to be done about it */
+  if (write (fd, msg, len) != (ssize_t) len)
+    return;
+}
+
+static void
+handle_command (Freezer    *freezer,
+                pid_t       child,
+                int         control_fd,
+                const char *cmd,
+                int        *frozen)
+{
+  char buf[256];
+  int want;
+
+  if (strcmp (cmd, "status") == 0)
+    {
+      reply (control_fd, *frozen ? "frozen\n" : "running\n");
+      return;
+    }
+  else if (strcmp (cmd, "freeze") == 0)
+    want = 1;
+  else if (strcmp (cmd, "thaw") == 0)
+    want = 0;
+  else
+    {
+      snprintf (buf, sizeof (buf), "error unknown command %.200s\n", cmd);
+      reply (control_fd, buf);
+      return;
+    }
+
+  if (set_frozen (freezer, child, want) < 0)
+    {
+      snprintf (buf, sizeof (buf), "error %s\n", strerror (errno));
+      reply (control_fd, buf);
+      /* A partial freeze is still a freeze, as far as undoing it goes */
+      if (want)
+        *frozen = 1;
+      return;
+    }
+  *frozen = want;
+  reply (control_fd, *frozen ? "frozen\n" : "running\n");
+}
+
+/**
+ * freezer_serve:
+ * @freezer: A #Freezer
+ * @child: The container's first process
+ * @control_fd: Socket to read commands from and write replies to
+ * @stop_fd: (out): Close this to stop
+ *
+ * Fork a process which reads "freeze", "thaw" and "status" commands
+ * from @control_fd, one per line, and answers each with a line saying
+ * "frozen", "running", or "error" and a message.  The container is
+ * thawed again when the process stops, or if @control_fd is closed.
+ * Call after dropping privileges.  Returns the pid of the process,
+ * or -1 on error.
+ */
+pid_t
+freezer_serve (Freezer *freezer,
+               pid_t    child,
+               int      control_fd,
+               int     *stop_fd)
+{
+  int stop_pipe[2];
+  pid_t pid;
+
+  if (pipe2 (stop_pipe, O_CLOEXEC) < 0)
+    return -1;
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      int errsv = errno;
+      (void) close (stop_pipe[0]);
+      (void) close (stop_pipe[1]);
+      errno = errsv;
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      int keep[] = { control_fd, stop_pipe[0], freezer->cgroup_fd };
+      struct pollfd pfds[2];
+      char buf[256];
+      size_t buf_len = 0;
+      int frozen = 0;
+
+      if (close_fds (keep, freezer->cgroup_fd != -1 ? 3 : 2) < 0)
+        _exit (1);
+
+      pfds[0].fd = control_fd;
+      pfds[0].events = POLLIN;
+      pfds[1].fd = stop_pipe[0];
+      pfds[1].events = POLLIN;
+      for (;;)
+        {
+          char *nl;
+          ssize_t n;
+
+          if (poll (pfds, 2, -1) < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              break;
+            }
+          if (pfds[1].revents)
+            break;
+          if (!pfds[0].revents)
+            continue;
+
+          n = read (control_fd, buf + buf_len, sizeof (buf) - buf_len - 1);
+          if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+          if (n <= 0)
+            break;
+          buf_len += n;
+          buf[buf_len] = '\0';
+
+          while ((nl = strchr (buf, '\n')) != NULL)
+            {
+              *nl = '\0';
+              if (nl > buf && nl[-1] == '\r')
+                nl[-1] = '\0';
+              handle_command (freezer, child, control_fd, buf, &frozen);
+              buf_len -= nl + 1 - buf;
+              memmove (buf, nl + 1, buf_len + 1);
+            }
+          /* Nobody sends commands this long */
+          if (buf_len == sizeof (buf) - 1)
+            buf_len = 0;
+        }
+
+      /* Never leave the container stuck */
+      if (frozen)
+        (void) set_frozen (freezer, child, 0);
+      _exit (0);
+    }
+
+  (void) close (stop_pipe[0]);
+  *stop_fd = stop_pipe[1];
+  return pid;
+}
+
+/**
+ * freezer_free:
+ * @freezer: A #Freezer
+ *
+ * Remove the container's cgroup, once the child has exited.  If it
+ * still has processes in it, e.g. daemons which escaped without
+ * --unshare-pid, it is left behind.
+ */
+void
+freezer_free (Freezer *freezer)
+{
+  if (freezer->procs_fd != -1)
+    (void) close (freezer->procs_fd);
+  if (freezer->cgroup_fd != -1)
+    (void) close (freezer->cgroup_fd);
+  if (freezer->cgroup_path)
+    (void) rmdir (freezer->cgroup_path);
+  free (freezer->cgroup_path);
+  free (freezer);
+}
@@ -0,0 +1,566 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "ldcache.h"
+#include "setup-fds.h"
+#include "cleanup.h"
+
+#ifndef PR_SET_DUMPABLE
+#define PR_SET_DUMPABLE 4
+#endif
+
+/* Below the caller's cache directory */
+#define LDCACHE_DIR "linux-user-chroot"
+
+struct _Ldcache {
+  /* $XDG_CACHE_HOME, opened with the caller's privileges */
+  int base_fd;
+  int ldconfig_fd;
+  /* Set by ldcache_lookup() if there was no cache yet */
+  char missing[64];
+  char root_prefix[32];
+};
+
+/* Limits for parsing ld.so.conf, which the caller controls */
+#define LDCACHE_MAX_DIRS 64
+#define LDCACHE_MAX_INCLUDE_DEPTH 4
+#define LDCACHE_MAX_CONF_SIZE (64 * 1024)
+
+static const char *const ldconfig_paths[] = { "/sbin/ldconfig", "/usr/sbin/ldconfig" };
+
+/* Where ld.so looks without any configuration, on the usual
+ * architectures; ldconfig only adds these to what ld.so.conf lists.
+ */
+static const char *const default_dirs[] = {
+  "/lib", "/lib64", "/lib32", "/libx32", "/usr/lib", "/usr/lib64", "/usr/lib32", "/usr/libx32"
+};
+
+typedef struct {
+  uint64_t hash;
+  char *dirs[LDCACHE_MAX_DIRS];
+  unsigned int n_dirs;
+} LdcacheKey;
+
+static void
+hash_bytes (uint64_t   *hash,
+            const void *data,
+            size_t      len)
+{
+  const unsigned char *p = data;
+  size_t i;
+
+  /* FNV-1a */
+  for (i = 0; i < len; i++)
+    {
+      *hash ^= p[i];
+      *hash *= 0x100000001b3ULL;
+    }
+}
+
+static void
+hash_stat (uint64_t          *hash,
+           const struct stat *stbuf)
+{
+  uint64_t fields[] = {
+    stbuf->st_dev, stbuf->st_ino, stbuf->st_size,
+    stbuf->st_mtim.tv_sec, stbuf->st_mtim.tv_nsec,
+    stbuf->st_ctim.tv_sec, stbuf->st_ctim.tv_nsec
+  };
+  hash_bytes (hash, fields, sizeof (fields));
+}
+
+/* Resolve @path as it would be inside @root_fd */
+static int
+open_in_root (int         root_fd,
+              const char *path,
+              int         flags)
+{
+  struct open_how how;
+
+  memset (&how, 0, sizeof (how));
+  how.flags = flags | O_CLOEXEC;
+  how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+
+  return syscall (__NR_openat2, root_fd, path, &how, sizeof (how));
+}
+
+static void
+key_add_dir (LdcacheKey *key,
+             const char *dir,
+             size_t      len)
+{
+  unsigned int i;
+
+  if (key->n_dirs == LDCACHE_MAX_DIRS || len == 0 || dir[0] != '/')
+    return;
+  for (i = 0; i < key->n_dirs; i++)
+    {
+      if (strlen (key->dirs[i]) == len && strncmp (key->dirs[i], dir, len) == 0)
+        return;
+    }
+  key->dirs[key->n_dirs] = strndup (dir, len);
+  if (key->dirs[key->n_dirs])
+    key->n_dirs++;
+}
+
+static int
+compare_strings (const void *a,
+                 const void *b)
+{
+  return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+static void key_add_conf (LdcacheKey *key, int root_fd, const char *path, int depth);
+
+/* "include" takes a glob; like ldconfig, only the last component
+ * may have wildcards in practice, and relative patterns are relative
+ * to the including file's directory.
+ */
+static void
+key_add_include (LdcacheKey *key,
+                 int         root_fd,
+                 const char *conf_path,
+                 const char *pattern,
+                 int         depth)
+{
+  _cleanup_fd_close_ int dir_fd = -1;
+  struct stat stbuf;
+  char *full;
+  char *slash;
+  DIR *dir;
+  struct dirent *dent;
+  char **names = NULL;
+  size_t n_names = 0;
+  size_t i;
+
+  if (pattern[0] == '/')
+    full = strdup (pattern);
+  else if (asprintf (&full, "%.*s/%s", (int) (strrchr (conf_path, '/') - conf_path),
+                     conf_path, pattern) < 0)
+    full = NULL;
+  if (full == NULL)
+    return;
+
+  slash = strrchr (full, '/');
+  *slash = '\0';
+  dir_fd = open_in_root (root_fd, *full ? full : "/", O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0 || fstat (dir_fd, &stbuf) < 0)
+    {
+      free (full);
+      return;
+    }
+  /* Catches files being added or removed */
+  hash_stat (&key->hash, &stbuf);
+
+  dir = fdopendir (dir_fd);
+  if (dir == NULL)
+    {
+      free (full);
+      return;
+    }
+  dir_fd = -1;
+  while ((dent = readdir (dir)) != NULL)
+    {
+      char **new_names;
+
+      if (dent->d_name[0] == '.' || fnmatch (slash + 1, dent->d_name, 0) != 0)
+        continue;
+      new_names = realloc (names, (n_names + 1) * sizeof (char *));
+      if (new_names == NULL)
+        break;
+      names = new_names;
+      if (asprintf (&names[n_names], "%s/%s", full, dent->d_name) < 0)
+        break;
+      n_names++;
+    }
+  (void) closedir (dir);
+
+  qsort (names, n_names, sizeof (char *), compare_strings);
+  for (i = 0; i < n_names; i++)
+    {
+      key_add_conf (key, root_fd, names[i], depth + 1);
+      free (names[i]);
+    }
+  free (names);
+  free (full);
+}
+
+static void
+key_add_conf (LdcacheKey *key,
+              int         root_fd,
+              const char *path,
+              int         depth)
+{
+  _cleanup_fd_close_ int fd = -1;
+  char *buf;
+  char *line;
+  char *next;
+  ssize_t len;
+
+  hash_bytes (&key->hash, path, strlen (path) + 1);
+  if (depth > LDCACHE_MAX_INCLUDE_DEPTH)
+    return;
+
+  fd = open_in_root (root_fd, path, O_RDONLY);
+  if (fd < 0)
+    return;
+  buf = malloc (LDCACHE_MAX_CONF_SIZE + 1);
+  if (buf == NULL)
+    return;
+  do
+    len = read (fd, buf, LDCACHE_MAX_CONF_SIZE);
+  while (len < 0 && errno == EINTR);
+  if (len < 0)
+    len = 0;
+  buf[len] = '\0';
+  hash_bytes (&key->hash, buf, len);
+
+  for (line = buf; line; line = next)
+    {
+      size_t n;
+
+      next = strchr (line, '\n');
+      if (next)
+        *next++ = '\0';
+      line[strcspn (line, "#")] = '\0';
+      line += strspn (line, " \t");
+      n = strcspn (line, " \t=,:");
+
+      if (strncmp (line, "include", n) == 0 && n == 7)
+        {
+          char *pattern = line + n + strspn (line + n, " \t");
+          pattern[strcspn (pattern, " \t")] = '\0';
+          if (*pattern)
+            key_add_include (key, root_fd, path, pattern, depth);
+        }
+      else if (strncmp (line, "hwcap", n) != 0 || n != 5)
+        key_add_dir (key, line, n);
+    }
+
+  free (buf);
+}
+
+/* Everything the generated cache depends on: the configuration,
+ * the library directories' contents (a directory's mtime changes
+ * when entries are added, removed or replaced), and ldconfig itself.
+ */
+static void
+key_compute (LdcacheKey *key,
+             int         root_fd,
+             int         ldconfig_fd)
+{
+  struct stat stbuf;
+  unsigned int i;
+
+  key->hash = 0xcbf29ce484222325ULL;
+  key->n_dirs = 0;
+
+  if (fstat (ldconfig_fd, &stbuf) == 0)
+    hash_stat (&key->hash, &stbuf);
+
+  for (i = 0; i < sizeof (default_dirs) / sizeof (default_dirs[0]); i++)
+    key_add_dir (key, default_dirs[i], strlen (default_dirs[i]));
+  key_add_conf (key, root_fd, "/etc/ld.so.conf", 0);
+
+  for (i = 0; i < key->n_dirs; i++)
+    {
+      _cleanup_fd_close_ int fd = -1;
+
+      hash_bytes (&key->hash, key->dirs[i], strlen (key->dirs[i]) + 1);
+      fd = open_in_root (root_fd, key->dirs[i], O_PATH | O_DIRECTORY);
+      if (fd >= 0 && fstat (fd, &stbuf) == 0)
+        hash_stat (&key->hash, &stbuf);
+      free (key->dirs[i]);
+    }
+}
+
+/* Run ldconfig on the root we're in, writing to @tmp_name in the
+ * cache directory.  We're the caller by now, but still hold
+ * descriptors they mustn't get at; those are closed by the exec, and
+ * until then nobody may attach to us.
+ */
+static int
+run_ldconfig (Ldcache    *ldcache,
+              int         dir_fd,
+              const char *tmp_name)
+{
+  pid_t pid;
+  int status;
+
+  pid = fork ();
+  if (pid < 0)
+    return -1;
+
+  if (pid == 0)
+    {
+      char *const argv[] = { "ldconfig", "-X", "-i", "-C", (char *) tmp_name, NULL };
+      char *const envp[] = { NULL };
+
+      if (prctl (PR_SET_DUMPABLE, 0, 0, 0, 0) < 0)
+        _exit (1);
+      if (setup_fds (NULL, 0) < 0)
+        _exit (1);
+      /* A relative -C is written next to the other caches, outside
+       * the root */
+      if (fchdir (dir_fd) < 0)
+        _exit (1);
+
+      fexecve (ldcache->ldconfig_fd, argv, envp);
+      _exit (1);
+    }
+
+  while (waitpid (pid, &status, 0) < 0)
+    {
+      if (errno != EINTR)
+        return -1;
+    }
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      errno = ECHILD;
+      return -1;
+    }
+  return 0;
+}
+
+/* Remove caches for older states of the same root */
+static void
+prune_root (int         dir_fd,
+            const char *root_prefix,
+            const char *keep)
+{
+  DIR *dir;
+  struct dirent *dent;
+  int fd;
+
+  fd = openat (dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  dir = fdopendir (fd);
+  if (dir == NULL)
+    {
+      (void) close (fd);
+      return;
+    }
+  while ((dent = readdir (dir)) != NULL)
+    {
+      if (strncmp (dent->d_name, root_prefix, strlen (root_prefix)) == 0
+          && strcmp (dent->d_name, keep) != 0)
+        (void) unlinkat (dirfd (dir), dent->d_name, 0);
+    }
+  (void) closedir (dir);
+}
+
+/**
+ * ldcache_open:
+ * @uid: The calling user
+ *
+ * Open @uid's cache directory, $XDG_CACHE_HOME or ~/.cache, and the
+ * host's ldconfig, with @uid's privileges.  Must be called in the
+ * child's mount namespace while the host's tree is still visible, so
+ * that caches can be bind mounted from there.  Returns a new
+ * #Ldcache, or %NULL on error.
+ */
+Ldcache *
+ldcache_open (uid_t uid)
+{
+  Ldcache *ldcache;
+  const char *cache_home = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  char *path = NULL;
+  unsigned int i;
+  int errsv;
+
+  ldcache = calloc (1, sizeof (Ldcache));
+  if (ldcache == NULL)
+    return NULL;
+  ldcache->base_fd = -1;
+  ldcache->ldconfig_fd = -1;
+
+  if (cache_home && cache_home[0] == '/')
+    path = strdup (cache_home);
+  else if (home && home[0] == '/' && asprintf (&path, "%s/.cache", home) < 0)
+    path = NULL;
+  if (path == NULL)
+    {
+      errno = ENOENT;
+      goto err;
+    }
+
+  (void) setfsuid (uid);
+  ldcache->base_fd = open (path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  for (i = 0; i < sizeof (ldconfig_paths) / sizeof (ldconfig_paths[0]) && ldcache->ldconfig_fd < 0; i++)
+    ldcache->ldconfig_fd = open (ldconfig_paths[i], O_RDONLY | O_CLOEXEC);
+  errsv = errno;
+  (void) setfsuid (0);
+  errno = errsv;
+  free (path);
+
+  if (ldcache->base_fd < 0 || ldcache->ldconfig_fd < 0)
+    goto err;
+
+  return ldcache;
+
+ err:
+  errsv = errno;
+  ldcache_free (ldcache);
+  errno = errsv;
+  return NULL;
+}
+
+/**
+ * ldcache_lookup:
+ * @ldcache: From ldcache_open()
+ * @root_fd: Root directory of the container, with its mounts in place
+ * @uid: The calling user
+ *
+ * Find the cache for @root_fd, named by its identity and a hash of
+ * everything the cache depends on, so an up-to-date one is found
+ * with a handful of stat() calls.  Everything is read with @uid's
+ * privileges.  Returns a descriptor for the cache, or -1 on error;
+ * if there is none yet, ldcache_generate() will make it for next
+ * time.
+ */
+int
+ldcache_lookup (Ldcache *ldcache,
+                int      root_fd,
+                uid_t    uid)
+{
+  LdcacheKey key;
+  struct stat stbuf;
+  uint64_t root_hash = 0xcbf29ce484222325ULL;
+  char name[64];
+  int fd = -1;
+  int errsv;
+
+  (void) setfsuid (uid);
+
+  if (fstat (root_fd, &stbuf) < 0)
+    goto out;
+  hash_bytes (&root_hash, &stbuf.st_dev, sizeof (stbuf.st_dev));
+  hash_bytes (&root_hash, &stbuf.st_ino, sizeof (stbuf.st_ino));
+  snprintf (ldcache->root_prefix, sizeof (ldcache->root_prefix),
+            "ldcache-%016llx-", (unsigned long long) root_hash);
+
+  key_compute (&key, root_fd, ldcache->ldconfig_fd);
+  snprintf (name, sizeof (name), "%s%016llx", ldcache->root_prefix, (unsigned long long) key.hash);
+
+  fd = openat (ldcache->base_fd, LDCACHE_DIR "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      int dir_fd = fd;
+      fd = openat (dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+      errsv = errno;
+      (void) close (dir_fd);
+      errno = errsv;
+    }
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+        snprintf (ldcache->missing, sizeof (ldcache->missing), "%s", name);
+      goto out;
+    }
+  if (fstat (fd, &stbuf) < 0 || !S_ISREG (stbuf.st_mode))
+    {
+      (void) close (fd);
+      fd = -1;
+      errno = EINVAL;
+    }
+
+ out:
+  errsv = errno;
+  (void) setfsuid (0);
+  errno = errsv;
+  return fd;
+}
+
+/**
+ * ldcache_generate:
+ * @ldcache: From ldcache_open()
+ *
+ * If ldcache_lookup() found no cache, run the host's ldconfig to
+ * make one.  Must be called as the calling user, in the container's
+ * root; ldconfig gets no more than the command itself will.  Returns
+ * 0 on success, or if there was nothing to do.
+ */
+int
+ldcache_generate (Ldcache *ldcache)
+{
+  _cleanup_fd_close_ int dir_fd = -1;
+  char tmp_name[80];
+
+  if (!ldcache->missing[0])
+    return 0;
+
+  if (mkdirat (ldcache->base_fd, LDCACHE_DIR, 0755) < 0 && errno != EEXIST)
+    return -1;
+  dir_fd = openat (ldcache->base_fd, LDCACHE_DIR "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+    return -1;
+
+  /* Concurrent invocations may be making the same one */
+  snprintf (tmp_name, sizeof (tmp_name), "%s.%d", ldcache->missing, (int) getpid ());
+  if (run_ldconfig (ldcache, dir_fd, tmp_name) < 0)
+    {
+      int errsv = errno;
+      /* ldconfig writes to NAME~ first */
+      (void) unlinkat (dir_fd, tmp_name, 0);
+      strcat (tmp_name, "~");
+      (void) unlinkat (dir_fd, tmp_name, 0);
+      errno = errsv;
+      return -1;
+    }
+  if (renameat (dir_fd, tmp_name, dir_fd, ldcache->missing) < 0)
+    return -1;
+
+  prune_root (dir_fd, ldcache->root_prefix, ldcache->missing);
+  return 0;
+}
+
+/**
+ * ldcache_free:
+ * @ldcache: From ldcache_open()
+ */
+void
+ldcache_free (Ldcache *ldcache)
+{
+  if (ldcache->base_fd >= 0)
+    (void) close (ldcache->base_fd);
+  if (ldcache->ldconfig_fd >= 0)
+    (void) close (ldcache->ldconfig_fd);
+  free (ldcache);
+}
@@ -39,17 +39,30 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/fsuid.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 #include <sched.h>
+#include <time.h>
 
 #include "setup-seccomp.h"
 #include "setup-dev.h"
+#include "setup-loop.h"
+#include "metrics.h"
+#include "setup-fds.h"
+#include "export.h"
+#include "admission.h"
+#include "netns-pool.h"
+#include "prefetch.h"
+#include "freezer.h"
+#include "setup-mount-fd.h"
+#include "ldcache.h"
 
 #ifndef PR_SET_NO_NEW_PRIVS
 #define PR_SET_NO_NEW_PRIVS	38
@@ -65,6 +78,10 @@
  */
 #define MAX_BIND_MOUNTS 1024
 
+#ifndef FUSE_SUPER_MAGIC
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
+
 static void fatal (const char *message, ...) __attribute__ ((noreturn)) __attribute__ ((format (printf, 1, 2)));
 static void fatal_errno (const char *message) __attribute__ ((noreturn));
 
@@ -94,7 +111,9 @@ typedef enum {
   MOUNT_SPEC_BIND,
   MOUNT_SPEC_READONLY,
   MOUNT_SPEC_PROCFS,
-  MOUNT_SPEC_DEVAPI
+  MOUNT_SPEC_DEVAPI,
+  MOUNT_SPEC_IMAGE,
+  MOUNT_SPEC_LDCACHE
 } MountSpecType;
 
 typedef struct _MountSpec MountSpec;
@@ -103,10 +122,50 @@ struct _MountSpec {
 
   const char *source;
   const char *dest;
+  const char *fstype;
+  /* For MOUNT_SPEC_BIND from a descriptor instead of @source */
+  int source_fd;
   
   MountSpec *next;
 };
 
+typedef struct _ExportSpec ExportSpec;
+struct _ExportSpec {
+  const char *source;
+  const char *dest;
+
+  ExportSpec *next;
+};
+
+/* Make the mount just made at @dest read-only.  With --root-fd, @dest
+ * names a descriptor, which still refers to what's underneath; so look
+ * up the new mount by @spec_dest.
+ */
+static void
+remount_readonly (int         root_fd,
+                  const char *spec_dest,
+                  const char *dest)
+{
+  char path[64];
+  int fd = -1;
+
+  if (root_fd != -1)
+    {
+      fd = mount_open_beneath (root_fd, spec_dest);
+      if (fd < 0)
+        fatal_errno ("Couldn't open mount point below --root-fd");
+      snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+      dest = path;
+    }
+
+  if (mount (dest, dest,
+             NULL, MS_BIND | MS_PRIVATE | MS_REMOUNT | MS_RDONLY, NULL) < 0)
+    fatal_errno ("mount (MS_BIND | MS_RDONLY)");
+
+  if (fd != -1)
+    (void) close (fd);
+}
+
 static MountSpec *
 reverse_mount_list (MountSpec *mount)
 {
@@ -171,19 +230,22 @@ fsuid_fchdir (uid_t uid,
  * fsuid_open:
  * @uid: User id we should use
  * @path: Path string
+ * @flags: Flags for open()
+ * @mode: Mode for newly created files
  *
  * Like open() except we use the filesystem privileges of @uid.
  */
 static int
 fsuid_open (uid_t       uid,
             const char *path,
-            int         flags)
+            int         flags,
+            mode_t      mode)
 {
   int errsv;
   int ret;
   /* Note we don't check errors here because we can't, basically */
   (void) setfsuid (uid);
-  ret = open (path, flags);
+  ret = open (path, flags, mode);
   errsv = errno;
   (void) setfsuid (0);
   errno = errsv;
@@ -225,12 +287,109 @@ raw_clone (unsigned long flags, void *child_stack)
 #endif
 }
 
+static void
+append_fd (int          **fds,
+           unsigned int  *n_fds,
+           int            fd)
+{
+  *fds = realloc (*fds, sizeof (int) * (*n_fds + 1));
+  if (!*fds)
+    fatal ("Out of memory");
+  (*fds)[(*n_fds)++] = fd;
+}
+
+/* Parse the descriptor argument @arg of @option, which must be open */
+static int
+parse_fd_arg (const char *option,
+              const char *arg)
+{
+  char *end;
+  long fd;
+
+  errno = 0;
+  fd = strtol (arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || fd < 0 || fd > INT_MAX)
+    fatal ("Invalid %s %s", option, arg);
+  if (fcntl ((int) fd, F_GETFD) < 0)
+    fatal ("%s %ld is not open", option, fd);
+
+  return (int) fd;
+}
+
+/* Parse the numeric argument @arg of @option, at most @max */
+static unsigned int
+parse_uint_arg (const char   *option,
+                const char   *arg,
+                unsigned int  max)
+{
+  char *end;
+  long value;
+
+  errno = 0;
+  value = strtol (arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || value < 0 || value > (long) max)
+    fatal ("Invalid %s %s (must be 0 to %u)", option, arg, max);
+
+  return (unsigned int) value;
+}
+
+/* Parse the percentage @arg of @option */
+static double
+parse_percent_arg (const char *option,
+                   const char *arg)
+{
+  char *end;
+  double value;
+
+  errno = 0;
+  value = strtod (arg, &end);
+  /* Written so that NaN fails too */
+  if (errno != 0 || end == arg || *end != '\0' || !(value >= 0 && value <= 100))
+    fatal ("Invalid %s %s (must be 0 to 100)", option, arg);
+
+  return value;
+}
+
+/* Filesystem images are parsed by the kernel, so only mount ones the
+ * caller can't have crafted: owned by root, and writable by nobody
+ * else except the group configured for it.  Files on FUSE report
+ * whatever owner the filesystem likes.
+ */
+static int
+image_is_trusted (int                fd,
+                  const struct stat *st)
+{
+  struct statfs sfs;
+
+  if (fstatfs (fd, &sfs) < 0 || sfs.f_type == FUSE_SUPER_MAGIC)
+    return 0;
+  if (st->st_uid != 0 || (st->st_mode & S_IWOTH))
+    return 0;
+  if (st->st_mode & S_IWGRP)
+    return MOUNT_IMAGE_GID >= 0 && st->st_gid == (gid_t) MOUNT_IMAGE_GID;
+  return 1;
+}
+
+static uint64_t
+usec_since (const struct timespec *start)
+{
+  struct timespec now;
+
+  (void) clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) (now.tv_sec - start->tv_sec) * 1000000
+    + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
 int
 main (int      argc,
       char   **argv)
 {
   const char *argv0;
   const char *chroot_dir;
+  int root_fd = -1;
+  int root_tree_fd = -1;
+  int ldcache_auto = 0;
+  Ldcache *ldcache = NULL;
   const char *chdir_target = "/";
   const char *program;
   uid_t ruid, euid, suid;
@@ -244,11 +403,43 @@ main (int      argc,
   int unshare_ipc = 0;
   int unshare_net = 0;
   int unshare_pid = 0;
+  unsigned int netns_pool_size = 0;
+  int netns_lock_fd = -1;
   int seccomp_profile_version = -1;
+  int no_sync = 0;
   int clone_flags = 0;
   int child_status = 0;
+  const char *metrics_path = NULL;
+  int metrics_fd = -1;
+  struct timespec start_time;
+  uint64_t setup_usec = 0;
+  int exec_pipe[2] = { -1, -1 };
+  int *keep_fds = NULL;
+  unsigned int n_keep_fds = 0;
+  ExportSpec *exports = NULL;
+  ExportSpec **exports_tail = &exports;
+  ExportSpec *export_iter;
+  int export_failed = 0;
+  int exit_status_fd = -1;
+  int status_pipe[2] = { -1, -1 };
+  int have_status = 0;
+  int exit_code;
+  unsigned int n_mount_specs = 0;
+  const char *admission_path = NULL;
+  AdmissionLimits admission_limits = { 0, 0, -1, 60 };
+  const char *prefetch_path = NULL;
+  int prefetch_force_record = 0;
+  int prefetch_fanotify_fd = -1;
+  int prefetch_stop_fd = -1;
+  pid_t prefetch_recorder = -1;
+  int freeze_fd = -1;
+  Freezer *freezer = NULL;
+  int freezer_stop_fd = -1;
+  pid_t freezer_server = -1;
   pid_t child;
 
+  (void) clock_gettime (CLOCK_MONOTONIC, &start_time);
+
   if (argc <= 0)
     return 1;
 
@@ -279,20 +470,73 @@ main (int      argc,
           printf ("%s\n", PACKAGE_STRING);
           exit (0);
         }
+      else if (strcmp (arg, "--dump-metrics") == 0)
+        {
+          int fd;
+
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--dump-metrics takes one argument");
+
+          fd = fsuid_open (getuid (), argv[after_mount_arg_index+1], O_RDONLY | O_CLOEXEC, 0);
+          if (fd < 0)
+            fatal_errno ("Couldn't open metrics file");
+          if (metrics_dump (fd) < 0)
+            fatal_errno ("Couldn't read metrics file");
+          exit (0);
+        }
       else if (strcmp (arg, "--mount-bind") == 0)
         {
           if ((argc - after_mount_arg_index) < 3)
             fatal ("--mount-bind takes two arguments");
 
-          mount = malloc (sizeof (MountSpec));
+          mount = calloc (1, sizeof (MountSpec));
           mount->type = MOUNT_SPEC_BIND;
           mount->source = argv[after_mount_arg_index+1];
           mount->dest = argv[after_mount_arg_index+2];
+          mount->source_fd = -1;
+          mount->next = bind_mounts;
+          
+          bind_mounts = mount;
+          after_mount_arg_index += 3;
+        }
+      else if (strcmp (arg, "--mount-bind-fd") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 3)
+            fatal ("--mount-bind-fd takes two arguments");
+
+          mount = calloc (1, sizeof (MountSpec));
+          mount->type = MOUNT_SPEC_BIND;
+          mount->source = NULL;
+          mount->dest = argv[after_mount_arg_index+2];
+          mount->source_fd = parse_fd_arg (arg, argv[after_mount_arg_index+1]);
           mount->next = bind_mounts;
           
           bind_mounts = mount;
           after_mount_arg_index += 3;
         }
+      else if (strcmp (arg, "--ldcache") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--ldcache takes one argument");
+
+          if (strcmp (argv[after_mount_arg_index+1], "auto") != 0)
+            fatal ("Unknown --ldcache %s", argv[after_mount_arg_index+1]);
+          ldcache_auto = 1;
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--root-fd") == 0)
+        {
+          struct stat st;
+
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--root-fd takes one argument");
+
+          root_fd = parse_fd_arg (arg, argv[after_mount_arg_index+1]);
+          if (fstat (root_fd, &st) < 0 || !S_ISDIR (st.st_mode))
+            fatal ("--root-fd %d is not a directory", root_fd);
+
+          after_mount_arg_index += 2;
+        }
       else if (strcmp (arg, "--mount-readonly") == 0)
         {
           MountSpec *mount;
@@ -300,10 +544,11 @@ main (int      argc,
           if ((argc - after_mount_arg_index) < 2)
             fatal ("--mount-readonly takes one argument");
 
-          mount = malloc (sizeof (MountSpec));
+          mount = calloc (1, sizeof (MountSpec));
           mount->type = MOUNT_SPEC_READONLY;
           mount->source = NULL;
           mount->dest = argv[after_mount_arg_index+1];
+          mount->source_fd = -1;
           mount->next = bind_mounts;
           
           bind_mounts = mount;
@@ -316,10 +561,11 @@ main (int      argc,
           if ((argc - after_mount_arg_index) < 2)
             fatal ("--mount-proc takes one argument");
 
-          mount = malloc (sizeof (MountSpec));
+          mount = calloc (1, sizeof (MountSpec));
           mount->type = MOUNT_SPEC_PROCFS;
           mount->source = NULL;
           mount->dest = argv[after_mount_arg_index+1];
+          mount->source_fd = -1;
           mount->next = bind_mounts;
           
           bind_mounts = mount;
@@ -332,15 +578,42 @@ main (int      argc,
           if ((argc - after_mount_arg_index) < 2)
             fatal ("--mount-devapi takes one argument");
 
-          mount = malloc (sizeof (MountSpec));
+          mount = calloc (1, sizeof (MountSpec));
           mount->type = MOUNT_SPEC_DEVAPI;
           mount->source = NULL;
           mount->dest = argv[after_mount_arg_index+1];
+          mount->source_fd = -1;
           mount->next = bind_mounts;
           
           bind_mounts = mount;
           after_mount_arg_index += 2;
         }
+      else if (strcmp (arg, "--mount-image") == 0)
+        {
+          MountSpec *mount;
+
+          if ((argc - after_mount_arg_index) < 4)
+            fatal ("--mount-image takes three arguments");
+
+          mount = calloc (1, sizeof (MountSpec));
+          mount->type = MOUNT_SPEC_IMAGE;
+          mount->source = argv[after_mount_arg_index+1];
+          mount->dest = argv[after_mount_arg_index+2];
+          mount->source_fd = -1;
+          mount->next = bind_mounts;
+
+          /* "auto" probes the image for its type */
+          if (strcmp (argv[after_mount_arg_index+3], "auto") == 0)
+            mount->fstype = NULL;
+          else if (strcmp (argv[after_mount_arg_index+3], "erofs") == 0
+                   || strcmp (argv[after_mount_arg_index+3], "squashfs") == 0)
+            mount->fstype = argv[after_mount_arg_index+3];
+          else
+            fatal ("Unknown --mount-image type %s", argv[after_mount_arg_index+3]);
+          
+          bind_mounts = mount;
+          after_mount_arg_index += 4;
+        }
       else if (strcmp (arg, "--unshare-ipc") == 0)
         {
           unshare_ipc = 1;
@@ -356,6 +629,24 @@ main (int      argc,
           unshare_net = 1;
           after_mount_arg_index += 1;
         }
+      else if (strcmp (arg, "--netns-pool") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--netns-pool takes one argument");
+
+          /* Each slot is a mount in the host namespace, kept until
+           * reboot, so this is capped when building */
+          netns_pool_size = parse_uint_arg (arg, argv[after_mount_arg_index+1], NETNS_POOL_MAX);
+          if (netns_pool_size == 0)
+            fatal ("--netns-pool size must be at least 1");
+          unshare_net = 1;
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--no-sync") == 0)
+        {
+          no_sync = 1;
+          after_mount_arg_index += 1;
+        }
       else if (strcmp (arg, "--chdir") == 0)
         {
           if ((argc - after_mount_arg_index) < 2)
@@ -364,6 +655,112 @@ main (int      argc,
           chdir_target = argv[after_mount_arg_index+1];
           after_mount_arg_index += 2;
         }
+      else if (strcmp (arg, "--keep-fd") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--keep-fd takes one argument");
+
+          append_fd (&keep_fds, &n_keep_fds, parse_fd_arg (arg, argv[after_mount_arg_index+1]));
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--export") == 0)
+        {
+          ExportSpec *export;
+          const char *spec;
+          const char *colon;
+
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--export takes one argument");
+
+          spec = argv[after_mount_arg_index+1];
+          colon = strchr (spec, ':');
+          if (colon == NULL || colon == spec || colon[1] == '\0')
+            fatal ("--export argument must be PATH_IN_ROOT:HOST_DEST");
+
+          export = malloc (sizeof (ExportSpec));
+          export->source = strndup (spec, colon - spec);
+          export->dest = strdup (colon + 1);
+          export->next = NULL;
+
+          /* Keep command line order, so later exports win */
+          *exports_tail = export;
+          exports_tail = &export->next;
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--exit-status-fd") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--exit-status-fd takes one argument");
+
+          exit_status_fd = parse_fd_arg (arg, argv[after_mount_arg_index+1]);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--admission-file") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--admission-file takes one argument");
+
+          admission_path = argv[after_mount_arg_index+1];
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--admission-max-sandboxes") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--admission-max-sandboxes takes one argument");
+
+          admission_limits.max_sandboxes = parse_uint_arg (arg, argv[after_mount_arg_index+1], INT_MAX);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--admission-max-mounts") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--admission-max-mounts takes one argument");
+
+          admission_limits.max_mounts = parse_uint_arg (arg, argv[after_mount_arg_index+1], INT_MAX);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--admission-max-pressure") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--admission-max-pressure takes one argument");
+
+          admission_limits.max_pressure = parse_percent_arg (arg, argv[after_mount_arg_index+1]);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--admission-timeout") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--admission-timeout takes one argument");
+
+          admission_limits.timeout_sec = parse_uint_arg (arg, argv[after_mount_arg_index+1], INT_MAX);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--prefetch-profile") == 0
+               || strcmp (arg, "--prefetch-record") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("%s takes one argument", arg);
+
+          prefetch_path = argv[after_mount_arg_index+1];
+          prefetch_force_record = (strcmp (arg, "--prefetch-record") == 0);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--freeze-fd") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--freeze-fd takes one argument");
+
+          freeze_fd = parse_fd_arg (arg, argv[after_mount_arg_index+1]);
+          after_mount_arg_index += 2;
+        }
+      else if (strcmp (arg, "--metrics-file") == 0)
+        {
+          if ((argc - after_mount_arg_index) < 2)
+            fatal ("--metrics-file takes one argument");
+
+          metrics_path = argv[after_mount_arg_index+1];
+          after_mount_arg_index += 2;
+        }
       else if (strcmp (arg, "--seccomp-profile-version") == 0)
         {
           if ((argc - after_mount_arg_index) < 2)
@@ -376,13 +773,41 @@ main (int      argc,
         break;
     }
         
+  /* After everything else, so it sees the same libraries the command will */
+  if (ldcache_auto)
+    {
+      MountSpec *mount = calloc (1, sizeof (MountSpec));
+      mount->type = MOUNT_SPEC_LDCACHE;
+      mount->source = NULL;
+      mount->dest = "/etc/ld.so.cache";
+      mount->source_fd = -1;
+      mount->next = bind_mounts;
+      bind_mounts = mount;
+    }
+
+  /* Slots are counted in the file; without one there's nothing to count */
+  if (!admission_path && (admission_limits.max_sandboxes > 0 || admission_limits.max_mounts > 0))
+    fatal ("--admission-max-sandboxes and --admission-max-mounts need --admission-file");
+
   bind_mounts = reverse_mount_list (bind_mounts);
+  for (bind_mount_iter = bind_mounts; bind_mount_iter; bind_mount_iter = bind_mount_iter->next)
+    n_mount_specs++;
 
-  if ((argc - after_mount_arg_index) < 2)
-    fatal ("usage: %s [--unshare-ipc] [--unshare-pid] [--unshare-net] [--mount-proc DIR] [--mount-readonly DIR] [--mount-bind SOURCE DEST] [--chdir DIR] ROOTDIR PROGRAM ARGS...", argv0);
-  chroot_dir = argv[after_mount_arg_index];
-  program = argv[after_mount_arg_index+1];
-  program_argv = argv + after_mount_arg_index + 1;
+  /* With --root-fd there's no ROOTDIR */
+  if ((argc - after_mount_arg_index) < (root_fd != -1 ? 1 : 2))
+    fatal ("usage: %s [--unshare-ipc] [--unshare-pid] [--unshare-net] [--netns-pool N] [--no-sync] [--mount-proc DIR] [--mount-readonly DIR] [--mount-bind SOURCE DEST] [--mount-bind-fd FD DEST] [--ldcache auto] [--mount-image FILE DEST erofs|squashfs|auto] [--chdir DIR] [--metrics-file FILE] [--keep-fd FD] [--export PATH:DEST] [--exit-status-fd FD] [--admission-file FILE] [--prefetch-profile FILE] [--freeze-fd FD] (ROOTDIR | --root-fd FD) PROGRAM ARGS...", argv0);
+  if (root_fd != -1)
+    {
+      chroot_dir = NULL;
+      program = argv[after_mount_arg_index];
+      program_argv = argv + after_mount_arg_index;
+    }
+  else
+    {
+      chroot_dir = argv[after_mount_arg_index];
+      program = argv[after_mount_arg_index+1];
+      program_argv = argv + after_mount_arg_index + 1;
+    }
 
   if (getresgid (&rgid, &egid, &sgid) < 0)
     fatal_errno ("getresgid");
@@ -392,6 +817,121 @@ main (int      argc,
   if (rgid == 0)
     rgid = ruid;
 
+  if (metrics_path)
+    {
+      metrics_fd = fsuid_open (ruid, metrics_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (metrics_fd < 0)
+        fatal_errno ("Couldn't open metrics file");
+      if (metrics_init (metrics_fd) < 0)
+        fatal_errno ("Couldn't read metrics file");
+
+      /* The write end is closed by the exec, which is how the parent
+       * learns setup has finished. */
+      if (pipe2 (exec_pipe, O_CLOEXEC) < 0)
+        fatal_errno ("pipe2");
+    }
+
+  /* Wait our turn, if asked to.  The slots stay ours until this
+   * descriptor is gone, i.e. until we and the container have exited.
+   */
+  if (admission_path || admission_limits.max_pressure >= 0)
+    {
+      int fd = -1;
+
+      if (admission_path)
+        {
+          fd = fsuid_open (ruid, admission_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+          if (fd < 0)
+            fatal_errno ("Couldn't open admission file");
+        }
+      if (admission_acquire (fd, &admission_limits, n_mount_specs) < 0)
+        {
+          if (errno == ETIMEDOUT)
+            fatal ("Timed out waiting for admission after %u seconds", admission_limits.timeout_sec);
+          else if (errno == E2BIG)
+            fatal ("%u mounts exceeds --admission-max-mounts", n_mount_specs);
+          fatal_errno ("Waiting for admission");
+        }
+    }
+
+  /* Record a profile if asked to, or if there isn't one yet.  The
+   * fanotify group needs privileges and must be shared with the child,
+   * so is created here; the child marks its root mount. */
+  if (prefetch_path)
+    {
+      struct stat st;
+
+      if (!prefetch_force_record)
+        {
+          (void) setfsuid (ruid);
+          prefetch_force_record = (stat (prefetch_path, &st) < 0 && errno == ENOENT);
+          (void) setfsuid (0);
+        }
+      if (prefetch_force_record)
+        {
+          prefetch_fanotify_fd = prefetch_record_init ();
+          if (prefetch_fanotify_fd < 0)
+            perror ("Couldn't record prefetch profile");
+        }
+    }
+
+  if (exit_status_fd != -1)
+    {
+      if (pipe2 (status_pipe, O_CLOEXEC) < 0)
+        fatal_errno ("pipe2");
+    }
+
+  /* Descriptors from the caller refer to mounts in our namespace,
+   * which the child can't use once it has its own; take detached
+   * copies it can attach there instead.  Permissions are checked by
+   * the child, as for paths.
+   */
+  if (root_fd != -1)
+    {
+      root_tree_fd = mount_clone_tree (root_fd, 1);
+      if (root_tree_fd < 0)
+        fatal_errno ("Couldn't clone --root-fd (needs Linux 5.6)");
+    }
+  for (bind_mount_iter = bind_mounts; bind_mount_iter; bind_mount_iter = bind_mount_iter->next)
+    {
+      if (bind_mount_iter->type == MOUNT_SPEC_BIND && bind_mount_iter->source_fd != -1)
+        {
+          bind_mount_iter->source_fd = mount_clone_tree (bind_mount_iter->source_fd, 0);
+          if (bind_mount_iter->source_fd < 0)
+            fatal_errno ("Couldn't clone --mount-bind-fd (needs Linux 5.6)");
+        }
+      else if (bind_mount_iter->type == MOUNT_SPEC_IMAGE)
+        {
+          int fd = -1;
+          struct stat st;
+          /* As with bind mounts, the caller must be able to read the image */
+          fd = fsuid_open (ruid, bind_mount_iter->source, O_RDONLY | O_CLOEXEC, 0);
+          if (fd < 0)
+            fatal ("Couldn't open image mount source");
+          if (fsuid_fstat (ruid, fd, &st) < 0)
+            fatal ("Couldn't fstat image mount source");
+          if (!S_ISREG (st.st_mode))
+            fatal ("Image mount source must be a regular file");
+          if (!image_is_trusted (fd, &st))
+            fatal ("Image mount source must be owned by root and not writable by others");
+          /* The loop device is set up here, in our namespace, and the
+           * child attaches the mount like a --mount-bind-fd */
+          bind_mount_iter->source_fd = setup_loop_image (fd, bind_mount_iter->fstype);
+          if (bind_mount_iter->source_fd < 0)
+            fatal_errno ("mounting image");
+          (void) close (fd);
+        }
+    }
+
+  /* Creating the container's cgroup, if we can, has to happen while
+   * we're still root; it's done with the caller's privileges. */
+  if (freeze_fd != -1)
+    {
+      freezer = freezer_new (ruid);
+      if (freezer == NULL)
+        fatal ("out of memory");
+    }
+
   /* CLONE_NEWNS makes it so that when we create bind mounts below,
    * we're only affecting our children, not the entire system.  This
    * way it's harmless to bind mount e.g. /proc over an arbitrary
@@ -410,8 +950,18 @@ main (int      argc,
   if (unshare_pid)
     clone_flags |= CLONE_NEWPID;
 
-  /* Isolated networking */
-  if (unshare_net)
+  /* Isolated networking.  Creating and destroying a network namespace
+   * is much slower than the others (it waits for RCU grace periods
+   * under a global lock), so optionally reuse pinned ones; the child
+   * then simply inherits ours.
+   */
+  if (netns_pool_size > 0)
+    {
+      netns_lock_fd = netns_pool_enter (ruid, netns_pool_size);
+      if (netns_lock_fd < 0)
+        fatal_errno ("Couldn't enter pooled network namespace");
+    }
+  else if (unshare_net)
     clone_flags |= CLONE_NEWNET;
 
   if ((child = raw_clone (clone_flags, NULL)) < 0)
@@ -419,6 +969,19 @@ main (int      argc,
 
   if (child == 0)
     {
+      const char *makeflags;
+
+      /* Only the parent reports to the caller; holding this open
+       * would just delay EOF for them. */
+      if (exit_status_fd != -1)
+        (void) close (exit_status_fd);
+      if (freeze_fd != -1)
+        (void) close (freeze_fd);
+
+      /* Join our cgroup before anything else could fork */
+      if (freezer && freezer_enter (freezer) < 0)
+        fatal_errno ("Couldn't join freezer cgroup");
+
       /*
        * First, we attempt to use PR_SET_NO_NEW_PRIVS, since it does
        * exactly what we want - ensures the child can not gain any
@@ -429,6 +992,51 @@ main (int      argc,
       if (prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
         fatal_errno ("prctl (PR_SET_NO_NEW_PRIVS)");
 
+      /* Pass through the GNU make jobserver so nested makes share the
+       * caller's job slots.  A fifo is opened here, while its path
+       * still resolves, and handed over as a descriptor instead.  If
+       * anything is wrong, we leave MAKEFLAGS alone; make will warn
+       * and fall back to -j1 itself.
+       */
+      makeflags = getenv ("MAKEFLAGS");
+      if (makeflags)
+        {
+          int jobserver_rfd, jobserver_wfd;
+          char *jobserver_fifo;
+
+          if (jobserver_parse_makeflags (makeflags, &jobserver_rfd, &jobserver_wfd,
+                                         &jobserver_fifo) == 0)
+            {
+              if (jobserver_fifo)
+                {
+                  struct stat st;
+                  int fd = fsuid_open (ruid, jobserver_fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+                  int fl = fd >= 0 ? fcntl (fd, F_GETFL) : -1;
+
+                  /* O_NONBLOCK only guards the open; make expects
+                   * blocking reads from the fifo */
+                  if (fl != -1 && fstat (fd, &st) == 0 && S_ISFIFO (st.st_mode)
+                      && fcntl (fd, F_SETFL, fl & ~O_NONBLOCK) == 0)
+                    {
+                      char *new_makeflags = jobserver_rewrite_makeflags (makeflags, fd);
+                      if (!new_makeflags || setenv ("MAKEFLAGS", new_makeflags, 1) < 0)
+                        fatal ("Out of memory");
+                      free (new_makeflags);
+                      append_fd (&keep_fds, &n_keep_fds, fd);
+                    }
+                  else if (fd >= 0)
+                    (void) close (fd);
+                  free (jobserver_fifo);
+                }
+              else if (fcntl (jobserver_rfd, F_GETFD) != -1
+                       && fcntl (jobserver_wfd, F_GETFD) != -1)
+                {
+                  append_fd (&keep_fds, &n_keep_fds, jobserver_rfd);
+                  append_fd (&keep_fds, &n_keep_fds, jobserver_wfd);
+                }
+            }
+        }
+
       /* The rootfs propagation by default will be private, because
        * systemd sets it up that way.  However, some utilities will make it
        * shared, e.g. the "sandbox" tool on Fedora.
@@ -449,27 +1057,72 @@ main (int      argc,
       if (mount (NULL, "/", "none", MS_PRIVATE | MS_REMOUNT | MS_NOSUID, NULL) < 0)
         fatal_errno ("mount(/, MS_PRIVATE | MS_REC | MS_NOSUID)");
 
+      /* Caches are kept with the caller's, which --root-fd is about
+       * to cover; a failure just means running without one. */
+      if (ldcache_auto)
+        {
+          ldcache = ldcache_open (ruid);
+          if (ldcache == NULL)
+            perror ("Couldn't open ld.so.cache directory");
+        }
+
+      /* With --root-fd, the root goes in place first, and mount points
+       * are looked up from it rather than by path; the kernel makes
+       * sure they stay below it.
+       */
+      if (root_tree_fd != -1)
+        {
+          if (mount_attach_tree (root_tree_fd, "/") < 0)
+            fatal_errno ("Couldn't mount --root-fd");
+        }
+
       /* Now let's set up our bind mounts */
       for (bind_mount_iter = bind_mounts; bind_mount_iter; bind_mount_iter = bind_mount_iter->next)
         {
           char *dest;
+          int dest_fd = -1;
           
-          asprintf (&dest, "%s%s", chroot_dir, bind_mount_iter->dest);
+          if (root_tree_fd != -1)
+            {
+              dest_fd = mount_open_beneath (root_tree_fd, bind_mount_iter->dest);
+              /* Checked below; a missing cache isn't fatal */
+              if (dest_fd < 0 && !(bind_mount_iter->type == MOUNT_SPEC_LDCACHE && errno == ENOENT))
+                {
+                  perror (bind_mount_iter->dest);
+                  fatal ("Couldn't open mount point below --root-fd");
+                }
+              asprintf (&dest, "/proc/self/fd/%d", dest_fd);
+            }
+          else
+            asprintf (&dest, "%s%s", chroot_dir, bind_mount_iter->dest);
           
           if (bind_mount_iter->type == MOUNT_SPEC_READONLY)
             {
               if (mount (dest, dest,
                          NULL, MS_BIND | MS_PRIVATE, NULL) < 0)
                 fatal_errno ("mount (MS_BIND)");
-              if (mount (dest, dest,
-                         NULL, MS_BIND | MS_PRIVATE | MS_REMOUNT | MS_RDONLY, NULL) < 0)
-                fatal_errno ("mount (MS_BIND | MS_RDONLY)");
+              remount_readonly (root_tree_fd, bind_mount_iter->dest, dest);
+            }
+          else if (bind_mount_iter->type == MOUNT_SPEC_BIND && bind_mount_iter->source_fd != -1)
+            {
+              char src[64];
+              int fd;
+
+              /* The caller had the descriptor, but must also be able
+               * to read what it refers to, as with a path */
+              snprintf (src, sizeof (src), "/proc/self/fd/%d", bind_mount_iter->source_fd);
+              fd = fsuid_open (ruid, src, O_RDONLY | O_CLOEXEC, 0);
+              if (fd < 0)
+                fatal ("Couldn't open bind mount source");
+              (void) close (fd);
+              if (mount_attach_tree (bind_mount_iter->source_fd, dest) < 0)
+                fatal_errno ("mount (MS_BIND)");
             }
           else if (bind_mount_iter->type == MOUNT_SPEC_BIND)
             {
               int fd = -1;
               struct stat st;
-              fd = fsuid_open (ruid, bind_mount_iter->source, O_RDONLY);
+              fd = fsuid_open (ruid, bind_mount_iter->source, O_RDONLY, 0);
               if (fd < 0)
                 fatal ("Couldn't open bind mount source");
               if (fsuid_fstat (ruid, fd, &st) < 0)
@@ -499,22 +1152,82 @@ main (int      argc,
             }
           else if (bind_mount_iter->type == MOUNT_SPEC_DEVAPI)
             {
-              if (setup_dev (dest) < 0)
+              int r;
+              if (root_tree_fd != -1)
+                r = setup_dev_beneath (root_tree_fd, bind_mount_iter->dest);
+              else
+                r = setup_dev (dest);
+              if (r < 0)
                 fatal_errno ("setting up devapi");
             }
+          else if (bind_mount_iter->type == MOUNT_SPEC_IMAGE)
+            {
+              if (mount_attach_tree (bind_mount_iter->source_fd, dest) < 0)
+                fatal_errno ("mounting image");
+            }
+          else if (bind_mount_iter->type == MOUNT_SPEC_LDCACHE)
+            {
+              int cache_fd = -1;
+              int root = root_tree_fd;
+              int dest_check_fd = -1;
+              struct stat st;
+
+              /* This is purely an optimization, so never fail because
+               * of it.  There must be a file to mount on, though, as
+               * we won't change the root.  Everything is looked up
+               * as the caller, who must be able to get at the root
+               * anyway.
+               */
+              if (root == -1)
+                root = fsuid_open (ruid, chroot_dir, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+              if (dest_fd == -1)
+                dest_check_fd = fsuid_open (ruid, dest, O_PATH | O_CLOEXEC, 0);
+              if (ldcache == NULL || root < 0)
+                ;
+              else if (fsuid_fstat (ruid, dest_fd != -1 ? dest_fd : dest_check_fd, &st) < 0
+                       || !S_ISREG (st.st_mode))
+                fprintf (stderr, "No /etc/ld.so.cache in root to mount --ldcache on\n");
+              else if ((cache_fd = ldcache_lookup (ldcache, root, ruid)) >= 0)
+                {
+                  int tree_fd = mount_clone_tree (cache_fd, 0);
+                  if (tree_fd < 0 || mount_attach_tree (tree_fd, dest) < 0)
+                    fatal_errno ("mount (MS_BIND)");
+                  remount_readonly (root_tree_fd, bind_mount_iter->dest, dest);
+                  (void) close (tree_fd);
+                  (void) close (cache_fd);
+                }
+              else if (errno != ENOENT)
+                perror ("Couldn't open ld.so.cache");
+              if (dest_check_fd != -1)
+                (void) close (dest_check_fd);
+              if (root != root_tree_fd && root >= 0)
+                (void) close (root);
+            }
           else
             assert (0);
           free (dest);
+          if (dest_fd != -1)
+            (void) close (dest_fd);
         }
 
-      if (fsuid_chdir (ruid, chroot_dir) < 0)
-        fatal_errno ("chdir");
+      if (root_tree_fd != -1)
+        {
+          if (fsuid_fchdir (ruid, root_tree_fd) < 0)
+            fatal_errno ("chdir");
+          if (chroot (".") < 0)
+            fatal_errno ("chroot");
+        }
+      else
+        {
+          if (fsuid_chdir (ruid, chroot_dir) < 0)
+            fatal_errno ("chdir");
 
-      if (mount (".", ".", NULL, MS_BIND | MS_PRIVATE, NULL) < 0)
-        fatal_errno ("mount (MS_BIND)");
+          if (mount (".", ".", NULL, MS_BIND | MS_PRIVATE, NULL) < 0)
+            fatal_errno ("mount (MS_BIND)");
+        }
 
       /* Only move if we're not actually just using / */
-      if (strcmp (chroot_dir, "/") != 0)
+      if (chroot_dir && strcmp (chroot_dir, "/") != 0)
         {
           if (mount (chroot_dir, "/", NULL, MS_MOVE, NULL) < 0)
             fatal_errno ("mount (MS_MOVE)");
@@ -522,6 +1235,9 @@ main (int      argc,
           if (chroot (".") < 0)
             fatal_errno ("chroot");
         }
+
+      if (prefetch_fanotify_fd != -1 && prefetch_record_mark (prefetch_fanotify_fd) < 0)
+        perror ("Couldn't record prefetch profile");
       
       /* Switch back to the uid of our invoking process.  These calls are
        * irrevocable - see setuid(2) */
@@ -530,9 +1246,18 @@ main (int      argc,
       if (setuid (ruid) < 0)
         fatal_errno ("setuid");
 
+      /* Without a cache for this root yet, make one for next time;
+       * ldconfig runs with no more than the command will. */
+      if (ldcache && ldcache_generate (ldcache) < 0)
+        perror ("Couldn't generate ld.so.cache");
+
       if (chdir (chdir_target) < 0)
         fatal_errno ("chdir");
 
+      /* Don't leak anything else the caller happened to have open */
+      if (setup_fds (keep_fds, n_keep_fds) < 0)
+        fatal_errno ("setting up file descriptors");
+
       /* Add the seccomp filters just before we exec */
       if (seccomp_profile_version == 0)
         setup_seccomp_v0 ();
@@ -541,6 +1266,40 @@ main (int      argc,
       else
         fatal ("Unknown --seccomp-profile-version");
 
+      if (no_sync)
+        setup_seccomp_nosync ();
+
+      /* The last process to leave the namespaces pays for tearing
+       * them down (unmounting everything, and with --unshare-pid
+       * killing and reaping whatever is left).  So run the program in
+       * a grandchild, and pass its status up as soon as it exits;
+       * we're the ones who take the slow path out.
+       */
+      if (status_pipe[1] != -1)
+        {
+          pid_t program_pid;
+          int program_status;
+
+          program_pid = fork ();
+          if (program_pid < 0)
+            fatal_errno ("fork");
+          if (program_pid > 0)
+            {
+              /* Let the exec alone signal the end of setup */
+              if (exec_pipe[1] != -1)
+                (void) close (exec_pipe[1]);
+
+              while (waitpid (program_pid, &program_status, 0) < 0)
+                {
+                  if (errno != EINTR)
+                    fatal_errno ("waitpid");
+                }
+              if (write (status_pipe[1], &program_status, sizeof (program_status)) != sizeof (program_status))
+                fatal_errno ("write");
+              _exit (0);
+            }
+        }
+
       if (execvp (program, program_argv) < 0)
         fatal_errno ("execv");
     }
@@ -552,12 +1311,182 @@ main (int      argc,
   if (setuid (ruid) < 0)
     fatal_errno ("setuid");
 
+  /* The child has its own copies of these */
+  if (root_tree_fd != -1)
+    (void) close (root_tree_fd);
+  for (bind_mount_iter = bind_mounts; bind_mount_iter; bind_mount_iter = bind_mount_iter->next)
+    {
+      if (bind_mount_iter->source_fd != -1)
+        (void) close (bind_mount_iter->source_fd);
+    }
+
+  /* Make sure the helpers below don't hold these open */
+  if (exec_pipe[1] != -1)
+    (void) close (exec_pipe[1]);
+  if (status_pipe[1] != -1)
+    (void) close (status_pipe[1]);
+
+  /* Warm the page cache while the child is still setting up */
+  if (prefetch_path && !prefetch_force_record)
+    {
+      int fd = open (prefetch_path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0 || prefetch_replay (fd) < 0)
+        perror ("Couldn't replay prefetch profile");
+      if (fd >= 0)
+        (void) close (fd);
+    }
+  else if (prefetch_fanotify_fd != -1)
+    {
+      char root_path[PATH_MAX];
+      const char *prefetch_root = chroot_dir;
+
+      /* Only used to check paths, so it doesn't matter if it's stale */
+      if (root_fd != -1)
+        {
+          char fd_path[64];
+          ssize_t len;
+
+          snprintf (fd_path, sizeof (fd_path), "/proc/self/fd/%d", root_fd);
+          len = readlink (fd_path, root_path, sizeof (root_path) - 1);
+          root_path[len > 0 ? len : 0] = '\0';
+          prefetch_root = len > 0 ? root_path : "/";
+        }
+
+      prefetch_recorder = prefetch_record (prefetch_fanotify_fd, prefetch_root,
+                                           prefetch_path, &prefetch_stop_fd);
+      if (prefetch_recorder < 0)
+        perror ("Couldn't record prefetch profile");
+      (void) close (prefetch_fanotify_fd);
+    }
+
+  if (freezer)
+    {
+      freezer_server = freezer_serve (freezer, child, freeze_fd, &freezer_stop_fd);
+      if (freezer_server < 0)
+        perror ("Couldn't start freezer");
+      (void) close (freeze_fd);
+    }
+
+  if (metrics_fd != -1)
+    {
+      char c;
+
+      while (read (exec_pipe[0], &c, 1) < 0 && errno == EINTR)
+        ;
+      setup_usec = usec_since (&start_time);
+      (void) close (exec_pipe[0]);
+    }
+
+  if (status_pipe[0] != -1)
+    {
+      ssize_t n;
+
+      do
+        n = read (status_pipe[0], &child_status, sizeof (child_status));
+      while (n < 0 && errno == EINTR);
+      /* Otherwise setup failed before the program ran */
+      have_status = (n == sizeof (child_status));
+      (void) close (status_pipe[0]);
+    }
+
   /* Kind of lame to sit around blocked in waitpid, but oh well. */
-  if (waitpid (child, &child_status, 0) < 0)
+  if (!have_status && waitpid (child, &child_status, 0) < 0)
     fatal_errno ("waitpid");
-  
-  if (WIFEXITED (child_status))
-    return WEXITSTATUS (child_status);
+
+  /* This thaws the container if it was left frozen, so teardown can
+   * finish */
+  if (freezer_server > 0)
+    {
+      int server_status;
+
+      (void) close (freezer_stop_fd);
+      if (waitpid (freezer_server, &server_status, 0) < 0)
+        fatal_errno ("waitpid");
+    }
+
+  if (prefetch_recorder > 0)
+    {
+      int recorder_status;
+
+      (void) close (prefetch_stop_fd);
+      if (waitpid (prefetch_recorder, &recorder_status, 0) < 0)
+        fatal_errno ("waitpid");
+    }
+
+  /* We're the calling user by now, so these copies can't do anything
+   * the caller couldn't do themselves.  Note only the root directory
+   * itself is visible here, not the child's mounts.
+   */
+  if (exports)
+    {
+      int export_root_fd = root_fd;
+      int open_errno = 0;
+
+      if (root_fd == -1)
+        {
+          export_root_fd = open (chroot_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+          open_errno = errno;
+        }
+
+      for (export_iter = exports; export_iter; export_iter = export_iter->next)
+        {
+          int r;
+
+          if (export_root_fd < 0)
+            {
+              r = -1;
+              errno = open_errno;
+            }
+          else
+            r = export_tree (export_root_fd, export_iter->source, export_iter->dest);
+          if (r < 0)
+            {
+              fprintf (stderr, "Couldn't export %s to %s: %s\n",
+                       export_iter->source, export_iter->dest, strerror (errno));
+              export_failed = 1;
+            }
+        }
+
+      if (root_fd == -1 && export_root_fd >= 0)
+        (void) close (export_root_fd);
+    }
+
+  if (WIFEXITED (child_status) && (WEXITSTATUS (child_status) != 0 || !export_failed))
+    exit_code = WEXITSTATUS (child_status);
   else
-    return 1;
+    exit_code = 1;
+
+  if (exit_status_fd != -1)
+    {
+      char buf[16];
+      int len = snprintf (buf, sizeof (buf), "%d\n", exit_code);
+
+      if (write (exit_status_fd, buf, len) != len)
+        perror ("write (exit status fd)");
+      (void) close (exit_status_fd);
+
+      /* The caller can move on now; wait for the namespaces to go */
+      if (have_status)
+        {
+          int teardown_status;
+          if (waitpid (child, &teardown_status, 0) < 0)
+            fatal_errno ("waitpid");
+        }
+    }
+
+  if (freezer)
+    freezer_free (freezer);
+
+  /* Our slot in the pool is free once the container is gone */
+  if (netns_lock_fd != -1)
+    (void) close (netns_lock_fd);
+
+  if (metrics_fd != -1)
+    {
+      metrics_record (metrics_fd, setup_usec, usec_since (&start_time),
+                      n_mount_specs, child_status);
+      (void) close (metrics_fd);
+    }
+  
+  return exit_code;
 }
@@ -0,0 +1,296 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "metrics.h"
+
+#define N_ELEMENTS(arr)		(sizeof (arr) / sizeof ((arr)[0]))
+
+#define METRICS_MAGIC 0x4d43554cU /* "LUCM" */
+#define METRICS_VERSION 1
+
+/* Bucket 0 is < 1us, bucket i counts [2^(i-1), 2^i) microseconds; the
+ * last one also catches anything longer (about 71 minutes).
+ */
+#define METRICS_N_BUCKETS 33
+
+typedef enum {
+  EXIT_CLASS_SUCCESS,
+  EXIT_CLASS_FAILURE,
+  EXIT_CLASS_SIGNALED,
+  EXIT_CLASS_LAST
+} ExitClass;
+
+static const char *const exit_class_names[] = { "success", "failure", "signaled" };
+
+/* This is an on-disk format shared between concurrent invocations;
+ * only ever append fields, and bump METRICS_VERSION on any other
+ * change.  It is only read and written with pread()/pwrite() while
+ * holding an OFD lock on the whole file, never mapped: the file
+ * belongs to the caller, who could truncate it under a mapping and
+ * kill us with SIGBUS.
+ */
+typedef struct _MetricsFile MetricsFile;
+
+struct _MetricsFile {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t invocations;
+  uint64_t exit_class[EXIT_CLASS_LAST];
+  uint64_t mounts_total;
+  uint64_t setup_usec_total;
+  uint64_t wall_usec_total;
+  uint64_t setup_usec_hist[METRICS_N_BUCKETS];
+  uint64_t wall_usec_hist[METRICS_N_BUCKETS];
+};
+
+static unsigned int
+usec_to_bucket (uint64_t usec)
+{
+  unsigned int bucket = 0;
+
+  while (usec > 0 && bucket < METRICS_N_BUCKETS - 1)
+    {
+      usec >>= 1;
+      bucket++;
+    }
+  return bucket;
+}
+
+static int
+lock_metrics (int fd,
+              int type)
+{
+  struct flock fl;
+  int r;
+
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+  do
+    r = fcntl (fd, F_OFD_SETLKW, &fl);
+  while (r < 0 && errno == EINTR);
+  return r;
+}
+
+/* Read the whole file, which must already be locked.  Returns 0 if it
+ * is empty, 1 if it holds valid metrics, and -1 otherwise.
+ */
+static int
+read_metrics (int          fd,
+              MetricsFile *metrics)
+{
+  struct stat stbuf;
+  ssize_t n;
+
+  if (fstat (fd, &stbuf) < 0)
+    return -1;
+  if (!S_ISREG (stbuf.st_mode))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  memset (metrics, 0, sizeof (*metrics));
+  do
+    n = pread (fd, metrics, sizeof (*metrics), 0);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return -1;
+  if (n == 0)
+    return 0;
+
+  if (n != sizeof (*metrics)
+      || metrics->magic != METRICS_MAGIC
+      || metrics->version > METRICS_VERSION)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return 1;
+}
+
+static int
+write_metrics (int                fd,
+               const MetricsFile *metrics)
+{
+  ssize_t n;
+
+  do
+    n = pwrite (fd, metrics, sizeof (*metrics), 0);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return -1;
+  if (n != sizeof (*metrics))
+    {
+      errno = EIO;
+      return -1;
+    }
+  return 0;
+}
+
+/* Returns the upper bound of the bucket containing the given
+ * percentile, which is as precise as a log2 histogram can be.
+ */
+static uint64_t
+hist_percentile (const uint64_t *hist,
+                 unsigned int    percentile)
+{
+  uint64_t total = 0;
+  uint64_t seen = 0;
+  uint64_t target;
+  unsigned int i;
+
+  for (i = 0; i < METRICS_N_BUCKETS; i++)
+    total += hist[i];
+  if (total == 0)
+    return 0;
+
+  target = (total * percentile + 99) / 100;
+  for (i = 0; i < METRICS_N_BUCKETS; i++)
+    {
+      seen += hist[i];
+      if (seen >= target)
+        break;
+    }
+  return i == 0 ? 1 : (uint64_t) 1 << i;
+}
+
+/**
+ * metrics_init:
+ * @fd: Read-write file descriptor
+ *
+ * Check that @fd holds metrics, initializing it if it is empty.  The
+ * descriptor must be kept open for metrics_record().
+ */
+int
+metrics_init (int fd)
+{
+  MetricsFile metrics;
+  int r;
+
+  if (lock_metrics (fd, F_WRLCK) < 0)
+    return -1;
+
+  r = read_metrics (fd, &metrics);
+  if (r == 0)
+    {
+      metrics.magic = METRICS_MAGIC;
+      metrics.version = METRICS_VERSION;
+      r = write_metrics (fd, &metrics);
+    }
+
+  (void) lock_metrics (fd, F_UNLCK);
+  return r < 0 ? -1 : 0;
+}
+
+/**
+ * metrics_record:
+ * @fd: Descriptor passed to metrics_init()
+ *
+ * Add one invocation to the metrics file @fd.  Errors are ignored;
+ * the file may have been changed since metrics_init().
+ */
+void
+metrics_record (int           fd,
+                uint64_t      setup_usec,
+                uint64_t      wall_usec,
+                unsigned int  n_mounts,
+                int           wait_status)
+{
+  MetricsFile metrics;
+  ExitClass exit_class;
+
+  if (WIFEXITED (wait_status) && WEXITSTATUS (wait_status) == 0)
+    exit_class = EXIT_CLASS_SUCCESS;
+  else if (WIFEXITED (wait_status))
+    exit_class = EXIT_CLASS_FAILURE;
+  else
+    exit_class = EXIT_CLASS_SIGNALED;
+
+  if (lock_metrics (fd, F_WRLCK) < 0)
+    return;
+
+  if (read_metrics (fd, &metrics) > 0)
+    {
+      metrics.invocations += 1;
+      metrics.exit_class[exit_class] += 1;
+      metrics.mounts_total += n_mounts;
+      metrics.setup_usec_total += setup_usec;
+      metrics.wall_usec_total += wall_usec;
+      metrics.setup_usec_hist[usec_to_bucket (setup_usec)] += 1;
+      metrics.wall_usec_hist[usec_to_bucket (wall_usec)] += 1;
+      (void) write_metrics (fd, &metrics);
+    }
+
+  (void) lock_metrics (fd, F_UNLCK);
+}
+
+/**
+ * metrics_dump:
+ * @fd: Readable file descriptor
+ *
+ * Print counts and p50/p99 latencies from the metrics file @fd to
+ * stdout, one "name value" pair per line.
+ */
+int
+metrics_dump (int fd)
+{
+  MetricsFile metrics;
+  unsigned int i;
+  int r;
+
+  if (lock_metrics (fd, F_RDLCK) < 0)
+    return -1;
+  r = read_metrics (fd, &metrics);
+  (void) lock_metrics (fd, F_UNLCK);
+  if (r <= 0)
+    {
+      if (r == 0)
+        errno = EINVAL;
+      return -1;
+    }
+
+  printf ("invocations %" PRIu64 "\n", metrics.invocations);
+  for (i = 0; i < N_ELEMENTS (exit_class_names); i++)
+    printf ("exit_%s %" PRIu64 "\n", exit_class_names[i], metrics.exit_class[i]);
+  printf ("mounts_total %" PRIu64 "\n", metrics.mounts_total);
+  printf ("setup_usec_total %" PRIu64 "\n", metrics.setup_usec_total);
+  printf ("setup_usec_p50 %" PRIu64 "\n", hist_percentile (metrics.setup_usec_hist, 50));
+  printf ("setup_usec_p99 %" PRIu64 "\n", hist_percentile (metrics.setup_usec_hist, 99));
+  printf ("wall_usec_total %" PRIu64 "\n", metrics.wall_usec_total);
+  printf ("wall_usec_p50 %" PRIu64 "\n", hist_percentile (metrics.wall_usec_hist, 50));
+  printf ("wall_usec_p99 %" PRIu64 "\n", hist_percentile (metrics.wall_usec_hist, 99));
+
+  return 0;
+}
@@ -0,0 +1,206 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/vfs.h>
+
+#include "netns-pool.h"
+#include "run-dir.h"
+#include "cleanup.h"
+
+#ifndef NSFS_MAGIC
+#define NSFS_MAGIC 0x6e736673
+#endif
+
+/* A namespace is only handed out again if nothing is left in it from
+ * last time: no sockets of any kind (abstract unix sockets especially,
+ * as they are scoped to the network namespace), and no interfaces
+ * besides lo.  Must be called from inside the namespace.
+ */
+static int
+netns_is_clean (void)
+{
+  static const char *const files[] = {
+    "/proc/self/net/unix", "/proc/self/net/tcp", "/proc/self/net/tcp6",
+    "/proc/self/net/udp", "/proc/self/net/udp6", "/proc/self/net/raw",
+    "/proc/self/net/raw6", "/proc/self/net/packet"
+  };
+  char line[512];
+  unsigned int i;
+  unsigned int n_lines;
+  FILE *f;
+
+  for (i = 0; i < sizeof (files) / sizeof (files[0]); i++)
+    {
+      f = fopen (files[i], "re");
+      if (f == NULL)
+        {
+          if (errno == ENOENT)
+            continue; /* Protocol not built in */
+          return 0;
+        }
+      /* Anything past the header is a socket */
+      n_lines = 0;
+      while (fgets (line, sizeof (line), f))
+        n_lines++;
+      fclose (f);
+      if (n_lines > 1)
+        return 0;
+    }
+
+  /* Two header lines, then one line per interface */
+  f = fopen ("/proc/self/net/dev", "re");
+  if (f == NULL)
+    return 0;
+  n_lines = 0;
+  while (fgets (line, sizeof (line), f))
+    {
+      if (++n_lines > 2 && strncmp (line + strspn (line, " "), "lo:", 3) != 0)
+        {
+          fclose (f);
+          return 0;
+        }
+    }
+  fclose (f);
+
+  return 1;
+}
+
+static int
+create_pinned_netns (int         dir_fd,
+                     const char *name,
+                     const char *path)
+{
+  _cleanup_fd_close_ int fd = -1;
+
+  fd = openat (dir_fd, name, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+  if (unshare (CLONE_NEWNET) < 0)
+    return -1;
+  if (mount ("/proc/self/ns/net", path, NULL, MS_BIND, NULL) < 0)
+    return -1;
+  return 0;
+}
+
+/**
+ * netns_pool_enter:
+ * @uid: User the namespace is for
+ * @pool_size: Maximum number of namespaces to keep for @uid
+ *
+ * Switch the calling process into an unused network namespace from
+ * @uid's pool, creating or replacing one if needed.  Namespaces are
+ * never shared between uids, and only reused once checked to be
+ * empty.  Returns a descriptor which keeps the namespace reserved
+ * for as long as it is open, or -1 on error.
+ */
+int
+netns_pool_enter (uid_t        uid,
+                  unsigned int pool_size)
+{
+  _cleanup_fd_close_ int dir_fd = -1;
+  int lock_fd = -1;
+  char name[16];
+  char path[64];
+  unsigned int slot;
+
+  if (pool_size > NETNS_POOL_MAX)
+    pool_size = NETNS_POOL_MAX;
+
+  /* Pinned namespaces live here, one directory per uid */
+  dir_fd = run_dir_open_user ("netns", uid);
+  if (dir_fd < 0)
+    return -1;
+
+  /* Byte N of the lock file reserves slot N, the same scheme as
+   * --admission-file uses; the kernel releases it when we exit. */
+  lock_fd = openat (dir_fd, "lock", O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (lock_fd < 0)
+    return -1;
+
+  for (slot = 0; slot < pool_size; slot++)
+    {
+      struct flock fl;
+
+      memset (&fl, 0, sizeof (fl));
+      fl.l_type = F_WRLCK;
+      fl.l_whence = SEEK_SET;
+      fl.l_start = slot;
+      fl.l_len = 1;
+      if (fcntl (lock_fd, F_OFD_SETLK, &fl) == 0)
+        break;
+      if (errno != EAGAIN && errno != EACCES)
+        goto err;
+    }
+
+  if (slot == pool_size)
+    {
+      /* Everything is in use; a fresh unpinned namespace is no worse
+       * than plain --unshare-net. */
+      if (unshare (CLONE_NEWNET) < 0)
+        goto err;
+      return lock_fd;
+    }
+
+  /* Mounting needs a path; this one can't be redirected */
+  snprintf (name, sizeof (name), "%u", slot);
+  snprintf (path, sizeof (path), "/proc/self/fd/%d/%u", dir_fd, slot);
+  {
+    _cleanup_fd_close_ int ns_fd = -1;
+    struct statfs sfs;
+
+    ns_fd = openat (dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (ns_fd >= 0 && fstatfs (ns_fd, &sfs) == 0 && sfs.f_type == NSFS_MAGIC)
+      {
+        if (setns (ns_fd, CLONE_NEWNET) < 0)
+          goto err;
+        if (netns_is_clean ())
+          return lock_fd;
+
+        /* Dirty; drop our pin and let the kernel free it once any
+         * remaining users are gone. */
+        if (umount2 (path, MNT_DETACH) < 0)
+          goto err;
+      }
+  }
+
+  if (create_pinned_netns (dir_fd, name, path) < 0)
+    goto err;
+
+  return lock_fd;
+
+ err:
+  {
+    int errsv = errno;
+    (void) close (lock_fd);
+    errno = errsv;
+  }
+  return -1;
+}
@@ -0,0 +1,345 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+
+#include "prefetch.h"
+#include "setup-fds.h"
+
+/* Files we've already seen, keyed by device and inode; an open
+ * addressing table that doubles when half full.
+ */
+typedef struct {
+  uint64_t *keys;
+  size_t    size;
+  size_t    n_used;
+} FileSet;
+
+static uint64_t
+file_key (const struct stat *stbuf)
+{
+  /* Zero marks an empty bucket, so make sure a key never is */
+  return ((uint64_t) stbuf->st_dev * 0x9e3779b97f4a7c15ULL) ^ stbuf->st_ino ^ 1;
+}
+
+static int
+file_set_add (FileSet  *set,
+              uint64_t  key)
+{
+  size_t i;
+
+  if (set->n_used * 2 >= set->size)
+    {
+      FileSet bigger = { NULL, set->size ? set->size * 2 : 1024, 0 };
+
+      bigger.keys = calloc (bigger.size, sizeof (uint64_t));
+      if (!bigger.keys)
+        return 0;
+      for (i = 0; i < set->size; i++)
+        if (set->keys[i])
+          (void) file_set_add (&bigger, set->keys[i]);
+      free (set->keys);
+      *set = bigger;
+    }
+
+  for (i = key & (set->size - 1); set->keys[i]; i = (i + 1) & (set->size - 1))
+    {
+      if (set->keys[i] == key)
+        return 0;
+    }
+  set->keys[i] = key;
+  set->n_used++;
+  return 1;
+}
+
+/**
+ * prefetch_record_init:
+ *
+ * Create the fanotify group used for recording.  This needs
+ * CAP_SYS_ADMIN, so must be called before dropping privileges, and
+ * before cloning the child so that it shares the group.  The queue
+ * keeps its default limit: the recorder runs as the caller, who could
+ * stop it and let the container queue events forever otherwise.
+ * Returns a fanotify descriptor, or -1 on error.
+ */
+int
+prefetch_record_init (void)
+{
+  return fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+                        O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+}
+
+/**
+ * prefetch_record_mark:
+ * @fanotify_fd: From prefetch_record_init()
+ *
+ * Called by the child once it is in the new root, to watch for files
+ * opened through the root mount.  That mount exists only in the
+ * child's namespace, so this sees the container's opens and nobody
+ * else's, and only once setup is done.
+ */
+int
+prefetch_record_mark (int fanotify_fd)
+{
+  return fanotify_mark (fanotify_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, "/");
+}
+
+/* The container's mounts aren't reachable from our root, so the path
+ * the kernel gives us for a file opened through them depends on the
+ * kernel version and how it was mounted.  Only keep a path if it
+ * names the same file from here, trying it both as given and as
+ * relative to @root.
+ */
+static int
+host_path_for (const char        *root,
+               const char        *path,
+               const struct stat *expected,
+               char              *out,
+               size_t             out_len)
+{
+  struct stat stbuf;
+
+  if (stat (path, &stbuf) == 0
+      && stbuf.st_dev == expected->st_dev && stbuf.st_ino == expected->st_ino)
+    {
+      snprintf (out, out_len, "%s", path);
+      return 1;
+    }
+
+  if ((size_t) snprintf (out, out_len, "%s%s", strcmp (root, "/") == 0 ? "" : root, path) < out_len
+      && stat (out, &stbuf) == 0
+      && stbuf.st_dev == expected->st_dev && stbuf.st_ino == expected->st_ino)
+    return 1;
+
+  return 0;
+}
+
+/* Returns 0 when the queue is empty, -1 on error.  Once the queue has
+ * overflowed, @truncated is set and later events are only drained, as
+ * the profile would have a gap otherwise.
+ */
+static int
+read_events (int         fanotify_fd,
+             const char *root,
+             FileSet    *seen,
+             FILE       *out,
+             int        *truncated)
+{
+  char buf[64 * 1024] __attribute__ ((aligned (__alignof__ (struct fanotify_event_metadata))));
+
+  for (;;)
+    {
+      struct fanotify_event_metadata *event;
+      ssize_t len;
+
+      len = read (fanotify_fd, buf, sizeof (buf));
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0 && errno == EAGAIN)
+        return 0;
+      if (len <= 0)
+        return -1;
+
+      for (event = (struct fanotify_event_metadata *) buf;
+           FAN_EVENT_OK (event, len);
+           event = FAN_EVENT_NEXT (event, len))
+        {
+          char fd_path[64];
+          char path[PATH_MAX];
+          char host_path[PATH_MAX];
+          struct stat stbuf;
+          ssize_t path_len;
+
+          if (event->mask & FAN_Q_OVERFLOW)
+            *truncated = 1;
+          if (event->fd < 0)
+            continue;
+
+          if (!*truncated && fstat (event->fd, &stbuf) == 0 && S_ISREG (stbuf.st_mode)
+              && file_set_add (seen, file_key (&stbuf)))
+            {
+              snprintf (fd_path, sizeof (fd_path), "/proc/self/fd/%d", event->fd);
+              path_len = readlink (fd_path, path, sizeof (path) - 1);
+              if (path_len > 0)
+                {
+                  path[path_len] = '\0';
+                  /* One path per line; skip anything we couldn't read back */
+                  if (path[0] == '/' && strchr (path, '\n') == NULL
+                      && host_path_for (root, path, &stbuf, host_path, sizeof (host_path)))
+                    fprintf (out, "%s\n", host_path);
+                }
+            }
+          (void) close (event->fd);
+        }
+    }
+}
+
+/**
+ * prefetch_record:
+ * @fanotify_fd: From prefetch_record_init()
+ * @root: Root directory of the container
+ * @profile_path: Where to write the list of files
+ * @stop_fd: (out): Close this to finish recording
+ *
+ * Fork a process which records regular files opened from inside the
+ * container, in first-open order, and writes their host paths to
+ * @profile_path when @stop_fd is closed.  Call after dropping privileges; the
+ * process opens files to read their paths with the caller's.
+ * Returns the pid of the process, or -1 on error.
+ */
+pid_t
+prefetch_record (int          fanotify_fd,
+                 const char  *root,
+                 const char  *profile_path,
+                 int         *stop_fd)
+{
+  int stop_pipe[2];
+  pid_t pid;
+
+  if (pipe2 (stop_pipe, O_CLOEXEC) < 0)
+    return -1;
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      int errsv = errno;
+      (void) close (stop_pipe[0]);
+      (void) close (stop_pipe[1]);
+      errno = errsv;
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      int keep[] = { fanotify_fd, stop_pipe[0] };
+      struct pollfd pfds[2];
+      FileSet seen = { NULL, 0, 0 };
+      int truncated = 0;
+      char *tmp_path;
+      FILE *out;
+
+      if (close_fds (keep, 2) < 0)
+        _exit (1);
+
+      if (asprintf (&tmp_path, "%s.tmp", profile_path) < 0)
+        _exit (1);
+      out = fopen (tmp_path, "we");
+      if (out == NULL)
+        {
+          perror ("Couldn't create prefetch profile");
+          _exit (1);
+        }
+
+      pfds[0].fd = fanotify_fd;
+      pfds[0].events = POLLIN;
+      pfds[1].fd = stop_pipe[0];
+      pfds[1].events = POLLIN;
+      for (;;)
+        {
+          if (poll (pfds, 2, -1) < 0 && errno != EINTR)
+            _exit (1);
+          if (read_events (fanotify_fd, root, &seen, out, &truncated) < 0)
+            _exit (1);
+          /* Closed, so the container is done; the events for all its
+           * opens were queued before that, and have just been read. */
+          if (pfds[1].revents)
+            break;
+        }
+
+      if (truncated)
+        fprintf (stderr, "Too many files opened; prefetch profile is truncated\n");
+
+      if (fclose (out) != 0 || rename (tmp_path, profile_path) < 0)
+        {
+          perror ("Couldn't write prefetch profile");
+          (void) unlink (tmp_path);
+          _exit (1);
+        }
+      _exit (0);
+    }
+
+  (void) close (stop_pipe[0]);
+  *stop_fd = stop_pipe[1];
+  return pid;
+}
+
+/**
+ * prefetch_replay:
+ * @profile_fd: Profile written by prefetch_record()
+ *
+ * Fork a process which starts reading every file listed in
+ * @profile_fd into the page cache, in order, so that the container
+ * finds them there.  Files which have gone or which the caller can't
+ * read are skipped.  Call after dropping privileges, and don't wait
+ * for the process; it exits by itself.  Returns its pid, or -1 on
+ * error.
+ */
+pid_t
+prefetch_replay (int profile_fd)
+{
+  pid_t pid;
+
+  pid = fork ();
+  if (pid != 0)
+    return pid;
+
+  {
+    FILE *in;
+    char path[PATH_MAX + 1];
+
+    if (close_fds (&profile_fd, 1) < 0)
+      _exit (1);
+    in = fdopen (profile_fd, "r");
+    if (in == NULL)
+      _exit (1);
+
+    while (fgets (path, sizeof (path), in))
+      {
+        size_t len = strlen (path);
+        struct stat stbuf;
+        int fd;
+
+        if (len == 0 || path[len - 1] != '\n')
+          continue;
+        path[len - 1] = '\0';
+
+        fd = open (path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0)
+          continue;
+        /* readahead() only queues the IO, so this is quick */
+        if (fstat (fd, &stbuf) == 0 && S_ISREG (stbuf.st_mode))
+          (void) readahead (fd, 0, stbuf.st_size);
+        (void) close (fd);
+      }
+    _exit (0);
+  }
+}
@@ -0,0 +1,107 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "run-dir.h"
+
+/* Open @name in @dir_fd, creating it if needed.  Don't trust anything
+ * we didn't make: it must be a directory owned by root and not
+ * writable by anyone else.  Returns a descriptor, or -1 on error.
+ */
+static int
+open_root_dir (int         dir_fd,
+               const char *name,
+               mode_t      mode)
+{
+  struct stat stbuf;
+  int fd;
+
+  if (mkdirat (dir_fd, name, mode) < 0 && errno != EEXIST)
+    return -1;
+  fd = openat (dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &stbuf) < 0)
+    goto err;
+  if (stbuf.st_uid != 0 || (stbuf.st_mode & 022) != 0)
+    {
+      errno = EPERM;
+      goto err;
+    }
+  /* The caller's umask applied when creating it */
+  if ((stbuf.st_mode & 07777) != mode && fchmod (fd, mode) < 0)
+    goto err;
+  return fd;
+
+ err:
+  {
+    int errsv = errno;
+    (void) close (fd);
+    errno = errsv;
+  }
+  return -1;
+}
+
+/**
+ * run_dir_open_user:
+ * @name: Subdirectory of RUN_DIR for one feature
+ * @uid: User the directory is for
+ *
+ * Open RUN_DIR/@name/@uid, creating any of them as needed.  Each
+ * level is looked up from the one before without following symbolic
+ * links, and checked to be owned by root; the last is only
+ * accessible to root.  Anything created or removed below it should
+ * likewise go through the returned descriptor rather than a path.
+ * Call in our own mount namespace.  Returns a descriptor, or -1 on
+ * error.
+ */
+int
+run_dir_open_user (const char *name,
+                   uid_t       uid)
+{
+  char uid_name[16];
+  int run_fd = -1;
+  int name_fd = -1;
+  int fd = -1;
+  int errsv;
+
+  snprintf (uid_name, sizeof (uid_name), "%u", (unsigned int) uid);
+
+  run_fd = open_root_dir (AT_FDCWD, RUN_DIR, 0755);
+  if (run_fd >= 0)
+    name_fd = open_root_dir (run_fd, name, 0755);
+  if (name_fd >= 0)
+    fd = open_root_dir (name_fd, uid_name, 0700);
+
+  errsv = errno;
+  if (name_fd >= 0)
+    (void) close (name_fd);
+  if (run_fd >= 0)
+    (void) close (run_fd);
+  errno = errsv;
+  return fd;
+}
@@ -40,15 +40,15 @@
 #include <sched.h>
 
 #include "setup-dev.h"
+#include "setup-mount-fd.h"
 #include "cleanup.h"
 
 #define N_ELEMENTS(arr)		(sizeof (arr) / sizeof ((arr)[0]))
 
-int
-setup_dev (const char  *dest_devdir)
+static int
+populate_dev (int dest_fd)
 {
   _cleanup_fd_close_ int src_fd = -1;
-  _cleanup_fd_close_ int dest_fd = -1;
   struct stat stbuf;
   unsigned int i;
   static const char *const devnodes[] = { "null", "zero", "full", "random", "urandom", "tty" };
@@ -57,14 +57,6 @@ setup_dev (const char  *dest_devdir)
   if (src_fd == -1)
     return -1;
 
-  if (mount ("tmpfs", dest_devdir,
-	     "tmpfs", MS_MGC_VAL | MS_PRIVATE | MS_NOSUID, "mode=0755") < 0)
-    return -1;
-
-  dest_fd = openat (AT_FDCWD, dest_devdir, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
-  if (dest_fd == -1)
-    return -1;
-
   for (i = 0; i < N_ELEMENTS (devnodes); i++)
     {
       const char *nodename = devnodes[i];
@@ -87,3 +79,55 @@ setup_dev (const char  *dest_devdir)
   return 0;
 }
 
+static int
+mount_dev (const char *dest_devdir)
+{
+  return mount ("tmpfs", dest_devdir,
+                "tmpfs", MS_MGC_VAL | MS_PRIVATE | MS_NOSUID, "mode=0755");
+}
+
+int
+setup_dev (const char  *dest_devdir)
+{
+  _cleanup_fd_close_ int dest_fd = -1;
+
+  if (mount_dev (dest_devdir) < 0)
+    return -1;
+
+  dest_fd = openat (AT_FDCWD, dest_devdir, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
+  if (dest_fd == -1)
+    return -1;
+
+  return populate_dev (dest_fd);
+}
+
+/**
+ * setup_dev_beneath:
+ * @root_fd: Root directory of the container
+ * @dest_devdir: Where to set up /dev, below @root_fd
+ *
+ * Like setup_dev(), but resolving @dest_devdir with
+ * mount_open_beneath().
+ */
+int
+setup_dev_beneath (int          root_fd,
+                   const char  *dest_devdir)
+{
+  _cleanup_fd_close_ int dest_fd = -1;
+  char path[64];
+
+  dest_fd = mount_open_beneath (root_fd, dest_devdir);
+  if (dest_fd == -1)
+    return -1;
+  snprintf (path, sizeof (path), "/proc/self/fd/%d", dest_fd);
+  if (mount_dev (path) < 0)
+    return -1;
+
+  /* The descriptor is for what's underneath; look up the new mount */
+  (void) close (dest_fd);
+  dest_fd = mount_open_beneath (root_fd, dest_devdir);
+  if (dest_fd == -1)
+    return -1;
+
+  return populate_dev (dest_fd);
+}
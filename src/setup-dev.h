@@ -22,3 +22,4 @@
 #pragma once
 
 int setup_dev (const char *dest);
+int setup_dev_beneath (int root_fd, const char *dest);
@@ -0,0 +1,267 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "setup-fds.h"
+
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+static int
+int_compare (const void *a,
+             const void *b)
+{
+  int ia = *(const int *) a;
+  int ib = *(const int *) b;
+  return (ia > ib) - (ia < ib);
+}
+
+/* Close, or just mark close-on-exec, descriptors @first to @last */
+static int
+close_range_compat (unsigned int first,
+                    unsigned int last,
+                    int          cloexec)
+{
+  static int have_close_range = 1;
+  struct rlimit rl;
+  unsigned int fd;
+
+  if (first > last)
+    return 0;
+
+  if (have_close_range)
+    {
+      if (syscall (__NR_close_range, first, last, cloexec ? CLOSE_RANGE_CLOEXEC : 0) == 0)
+        return 0;
+      /* ENOSYS before 5.9, EINVAL for the flag before 5.11 */
+      if (errno != ENOSYS && errno != EINVAL)
+        return -1;
+      have_close_range = 0;
+    }
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+      && last >= rl.rlim_cur)
+    last = rl.rlim_cur - 1;
+
+  for (fd = first; fd <= last && fd >= first; fd++)
+    {
+      if (cloexec)
+        {
+          int flags = fcntl (fd, F_GETFD);
+          if (flags != -1)
+            (void) fcntl (fd, F_SETFD, flags | FD_CLOEXEC);
+        }
+      else
+        (void) close (fd);
+    }
+  return 0;
+}
+
+static int
+close_all_except (const int    *keep_fds,
+                  unsigned int  n_keep_fds,
+                  int           cloexec)
+{
+  int *sorted;
+  unsigned int next = 3;
+  unsigned int i;
+
+  sorted = malloc (sizeof (int) * (n_keep_fds ? n_keep_fds : 1));
+  if (!sorted)
+    return -1;
+  memcpy (sorted, keep_fds, sizeof (int) * n_keep_fds);
+  qsort (sorted, n_keep_fds, sizeof (int), int_compare);
+
+  for (i = 0; i < n_keep_fds; i++)
+    {
+      if (sorted[i] < (int) next)
+        continue;
+      if (close_range_compat (next, sorted[i] - 1, cloexec) < 0)
+        goto err;
+      if (cloexec)
+        {
+          int flags = fcntl (sorted[i], F_GETFD);
+          if (flags != -1)
+            (void) fcntl (sorted[i], F_SETFD, flags & ~FD_CLOEXEC);
+        }
+      next = sorted[i] + 1;
+    }
+
+  if (close_range_compat (next, ~0U, cloexec) < 0)
+    goto err;
+
+  free (sorted);
+  return 0;
+
+ err:
+  free (sorted);
+  return -1;
+}
+
+/**
+ * setup_fds:
+ * @keep_fds: Descriptors to pass on
+ * @n_keep_fds: Length of @keep_fds
+ *
+ * Arrange for every descriptor other than stdio and @keep_fds to be
+ * closed when we exec, and for @keep_fds to stay open.  Rather than
+ * closing, we mark descriptors close-on-exec, so that ones we still
+ * use ourselves (e.g. to notice the exec) survive until the very end.
+ */
+int
+setup_fds (const int    *keep_fds,
+           unsigned int  n_keep_fds)
+{
+  return close_all_except (keep_fds, n_keep_fds, 1);
+}
+
+/**
+ * close_fds:
+ * @keep_fds: Descriptors to leave open
+ * @n_keep_fds: Length of @keep_fds
+ *
+ * Close every descriptor other than stdio and @keep_fds now; for
+ * helper processes which don't exec.
+ */
+int
+close_fds (const int    *keep_fds,
+           unsigned int  n_keep_fds)
+{
+  return close_all_except (keep_fds, n_keep_fds, 0);
+}
+
+static const char *
+find_jobserver_arg (const char *makeflags,
+                    size_t     *arg_len)
+{
+  static const char *const prefixes[] = { "--jobserver-auth=", "--jobserver-fds=" };
+  const char *found = NULL;
+  const char *p = makeflags;
+
+  /* Like make, the last occurrence wins */
+  while (*p)
+    {
+      size_t len;
+      unsigned int i;
+
+      while (*p == ' ')
+        p++;
+      len = strcspn (p, " ");
+      for (i = 0; i < sizeof (prefixes) / sizeof (prefixes[0]); i++)
+        {
+          if (strncmp (p, prefixes[i], strlen (prefixes[i])) == 0)
+            {
+              found = p;
+              *arg_len = len;
+            }
+        }
+      p += len;
+    }
+
+  return found;
+}
+
+/**
+ * jobserver_parse_makeflags:
+ * @makeflags: Value of MAKEFLAGS
+ * @read_fd: (out): Jobserver read descriptor, or -1
+ * @write_fd: (out): Jobserver write descriptor, or -1
+ * @fifo_path: (out): Newly allocated jobserver fifo path, or %NULL
+ *
+ * Find the GNU make jobserver in @makeflags, in either the
+ * descriptor form "R,W" or the make 4.4 form "fifo:PATH".
+ * Returns 0 if one was found, -1 otherwise.
+ */
+int
+jobserver_parse_makeflags (const char *makeflags,
+                           int        *read_fd,
+                           int        *write_fd,
+                           char      **fifo_path)
+{
+  const char *arg;
+  const char *value;
+  size_t arg_len = 0;
+
+  *read_fd = *write_fd = -1;
+  *fifo_path = NULL;
+
+  arg = find_jobserver_arg (makeflags, &arg_len);
+  if (arg == NULL)
+    return -1;
+  value = strchr (arg, '=') + 1;
+  arg_len -= value - arg;
+
+  if (strncmp (value, "fifo:", 5) == 0)
+    {
+      if (arg_len <= 5)
+        return -1;
+      *fifo_path = strndup (value + 5, arg_len - 5);
+      return *fifo_path ? 0 : -1;
+    }
+
+  if (sscanf (value, "%d,%d", read_fd, write_fd) != 2
+      || *read_fd < 0 || *write_fd < 0)
+    {
+      *read_fd = *write_fd = -1;
+      return -1;
+    }
+
+  return 0;
+}
+
+/**
+ * jobserver_rewrite_makeflags:
+ * @makeflags: Value of MAKEFLAGS
+ * @fd: Descriptor open read-write on the jobserver
+ *
+ * Returns a newly allocated copy of @makeflags pointing make at @fd
+ * for both reading and writing tokens, in place of a fifo path.
+ */
+char *
+jobserver_rewrite_makeflags (const char *makeflags,
+                             int         fd)
+{
+  const char *arg;
+  size_t arg_len = 0;
+  char *ret;
+
+  arg = find_jobserver_arg (makeflags, &arg_len);
+  if (arg == NULL)
+    return strdup (makeflags);
+
+  if (asprintf (&ret, "%.*s--jobserver-auth=%d,%d%s",
+                (int) (arg - makeflags), makeflags, fd, fd, arg + arg_len) < 0)
+    return NULL;
+  return ret;
+}
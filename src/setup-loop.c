@@ -0,0 +1,217 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/loop.h>
+
+#include "setup-loop.h"
+#include "cleanup.h"
+
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG 0
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+  uint32_t fd;
+  uint32_t block_size;
+  struct loop_info64 info;
+  uint64_t __reserved[8];
+};
+#endif
+
+#define SQUASHFS_MAGIC_LE "hsqs"
+#define EROFS_SUPER_OFFSET 1024
+#define EROFS_MAGIC_LE "\xe2\xe1\xf5\xe0"
+
+/* We only hand the kernel filesystems which were designed to be
+ * read-only images; in particular nothing with a journal to replay.
+ */
+static const char *
+probe_image_fstype (int image_fd)
+{
+  char magic[4];
+
+  if (pread (image_fd, magic, sizeof (magic), 0) == sizeof (magic)
+      && memcmp (magic, SQUASHFS_MAGIC_LE, sizeof (magic)) == 0)
+    return "squashfs";
+  if (pread (image_fd, magic, sizeof (magic), EROFS_SUPER_OFFSET) == sizeof (magic)
+      && memcmp (magic, EROFS_MAGIC_LE, sizeof (magic)) == 0)
+    return "erofs";
+
+  return NULL;
+}
+
+static int
+configure_loop (int loop_fd,
+                int image_fd)
+{
+  struct loop_config config;
+  struct loop_info64 info;
+
+  memset (&config, 0, sizeof (config));
+  config.fd = image_fd;
+  config.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+
+  if (ioctl (loop_fd, LOOP_CONFIGURE, &config) == 0)
+    return 0;
+
+  /* The backing filesystem may not support O_DIRECT; the page cache
+   * still gets shared between sandboxes, just with double caching.
+   */
+  if (errno == EINVAL)
+    {
+      config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+      if (ioctl (loop_fd, LOOP_CONFIGURE, &config) == 0)
+        return 0;
+    }
+
+  /* Kernels before 5.8 lack LOOP_CONFIGURE */
+  if (errno != EINVAL && errno != ENOTTY)
+    return -1;
+
+  if (ioctl (loop_fd, LOOP_SET_FD, image_fd) < 0)
+    return -1;
+  memset (&info, 0, sizeof (info));
+  info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+  if (ioctl (loop_fd, LOOP_SET_STATUS64, &info) < 0)
+    {
+      int errsv = errno;
+      (void) ioctl (loop_fd, LOOP_CLR_FD, 0);
+      errno = errsv;
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Mount @loop_path without attaching it anywhere yet */
+static int
+create_mount (const char *loop_path,
+              const char *fstype)
+{
+  _cleanup_fd_close_ int fs_fd = -1;
+
+  fs_fd = syscall (__NR_fsopen, fstype, FSOPEN_CLOEXEC);
+  if (fs_fd < 0)
+    return -1;
+  if (syscall (__NR_fsconfig, fs_fd, FSCONFIG_SET_STRING, "source", loop_path, 0) < 0
+      || syscall (__NR_fsconfig, fs_fd, FSCONFIG_SET_FLAG, "ro", NULL, 0) < 0
+      || syscall (__NR_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0)
+    return -1;
+
+  return syscall (__NR_fsmount, fs_fd, FSMOUNT_CLOEXEC,
+                  MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV);
+}
+
+/**
+ * setup_loop_image:
+ * @image_fd: Filesystem image
+ * @fstype: "erofs", "squashfs", or %NULL to detect it
+ *
+ * Attach @image_fd to a read-only loop device and mount it, nosuid
+ * and nodev.  Returns a descriptor for the detached mount, to be
+ * attached with mount_attach_tree(), or -1 on error.  Devices are
+ * opened by path, so this must be called before cloning the child,
+ * while nothing can have been mounted over our /dev.  Needs Linux 5.2.
+ */
+int
+setup_loop_image (int         image_fd,
+                  const char *fstype)
+{
+  _cleanup_fd_close_ int control_fd = -1;
+  _cleanup_fd_close_ int loop_fd = -1;
+  char loop_path[64];
+  unsigned int attempts;
+
+  if (fstype == NULL)
+    fstype = probe_image_fstype (image_fd);
+  if (fstype == NULL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  control_fd = open ("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if (control_fd == -1)
+    return -1;
+
+  /* Another process may grab the free device between GET_FREE and
+   * LOOP_CONFIGURE; that shows up as EBUSY, so just ask again.
+   */
+  for (attempts = 0; ; attempts++)
+    {
+      int loop_nr = ioctl (control_fd, LOOP_CTL_GET_FREE);
+      if (loop_nr < 0)
+        return -1;
+
+      snprintf (loop_path, sizeof (loop_path), "/dev/loop%d", loop_nr);
+      loop_fd = open (loop_path, O_RDONLY | O_CLOEXEC);
+      if (loop_fd == -1)
+        return -1;
+
+      if (configure_loop (loop_fd, image_fd) == 0)
+        break;
+      if (errno != EBUSY || attempts >= 16)
+        return -1;
+
+      (void) close (loop_fd);
+      loop_fd = -1;
+    }
+
+  /* With LO_FLAGS_AUTOCLEAR the device detaches itself once the
+   * last reference goes away; that's this mount if it succeeds, or
+   * our loop_fd if it doesn't.
+   */
+  return create_mount (loop_path, fstype);
+}
@@ -0,0 +1,120 @@
+/* 
+ * Copyright (C) 2026 The linux-user-chroot authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+/* Core libc/linux-headers stuff */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "setup-mount-fd.h"
+
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_openat2
+#define __NR_openat2 437
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOVE_MOUNT_T_SYMLINKS
+#define MOVE_MOUNT_T_SYMLINKS 0x00000010
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
+/**
+ * mount_open_beneath:
+ * @root_fd: Directory descriptor
+ * @path: Path below @root_fd; a leading / is ignored
+ *
+ * Returns an O_PATH descriptor for @path, resolved without ever
+ * leaving @root_fd (so ".." and absolute symbolic links which would
+ * escape it fail with EXDEV) and without following /proc magic links.
+ * Unlike the mount point itself, looking @path up again after
+ * mounting on it gives the new mount.
+ */
+int
+mount_open_beneath (int         root_fd,
+                    const char *path)
+{
+  struct open_how how;
+
+  while (*path == '/')
+    path++;
+
+  memset (&how, 0, sizeof (how));
+  how.flags = O_PATH | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+  return syscall (__NR_openat2, root_fd, *path ? path : ".", &how, sizeof (how));
+}
+
+/**
+ * mount_clone_tree:
+ * @fd: Descriptor for a file or directory
+ * @recursive: Whether to include mounts below @fd
+ *
+ * Returns a descriptor for a new detached bind mount of @fd, which
+ * can be attached in another mount namespace with
+ * mount_attach_tree().  Descriptors refer to mounts in the namespace
+ * they were opened in, and the kernel won't bind mount or mount on
+ * those from anywhere else; so this must be called before cloning
+ * the child, for descriptors passed in by the caller.
+ */
+int
+mount_clone_tree (int fd,
+                  int recursive)
+{
+  return syscall (__NR_open_tree, fd, "",
+                  OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_EMPTY_PATH
+                  | (recursive ? AT_RECURSIVE : 0));
+}
+
+/**
+ * mount_attach_tree:
+ * @tree_fd: From mount_clone_tree()
+ * @dest: Where to mount it
+ *
+ * Like mount (MS_BIND) from @tree_fd onto @dest, including following
+ * symbolic links in @dest.
+ */
+int
+mount_attach_tree (int         tree_fd,
+                   const char *dest)
+{
+  return syscall (__NR_move_mount, tree_fd, "", AT_FDCWD, dest,
+                  MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_SYMLINKS);
+}
@@ -85,6 +85,30 @@ die_oom (void)
   die ("Out of memory");
 }
 
+static void
+add_secondary_archs (scmp_filter_ctx seccomp)
+{
+  int r;
+
+  /* Add in all possible secondary archs we are aware of that
+   * this kernel might support. */
+#if defined(__i386__) || defined(__x86_64__)
+  r = seccomp_arch_add (seccomp, SCMP_ARCH_X86);
+  if (r < 0 && r != -EEXIST)
+    die_with_error ("Failed to add x86 architecture to seccomp filter");
+
+  r = seccomp_arch_add (seccomp, SCMP_ARCH_X86_64);
+  if (r < 0 && r != -EEXIST)
+    die_with_error ("Failed to add x86_64 architecture to seccomp filter");
+
+  r = seccomp_arch_add (seccomp, SCMP_ARCH_X32);
+  if (r < 0 && r != -EEXIST)
+    die_with_error ("Failed to add x32 architecture to seccomp filter");
+#else
+  (void) r;
+#endif
+}
+
 /*
  * We're calling this filter "v0" - any future additions or changes
  * should become new versions.  This helps ensure backwards
@@ -183,21 +207,7 @@ setup_seccomp_v0 (void)
   if (!seccomp)
     return die_oom ();
 
-  /* Add in all possible secondary archs we are aware of that
-   * this kernel might support. */
-#if defined(__i386__) || defined(__x86_64__)
-  r = seccomp_arch_add (seccomp, SCMP_ARCH_X86);
-  if (r < 0 && r != -EEXIST)
-    die_with_error ("Failed to add x86 architecture to seccomp filter");
-
-  r = seccomp_arch_add (seccomp, SCMP_ARCH_X86_64);
-  if (r < 0 && r != -EEXIST)
-    die_with_error ("Failed to add x86_64 architecture to seccomp filter");
-
-  r = seccomp_arch_add (seccomp, SCMP_ARCH_X32);
-  if (r < 0 && r != -EEXIST)
-    die_with_error ("Failed to add x32 architecture to seccomp filter");
-#endif
+  add_secondary_archs (seccomp);
 
   /* TODO: Should we filter the kernel keyring syscalls in some way?
    * We do want them to be used by desktop apps, but they could also perhaps
@@ -236,3 +246,47 @@ setup_seccomp_v0 (void)
 
   seccomp_release (seccomp);
 }
+
+/*
+ * Make the calls that flush data to disk succeed without doing
+ * anything.  This is separate from the versioned profiles and only
+ * makes sense for roots that are thrown away after the build: package
+ * manager scripts fsync constantly, which turns CPU bound work into
+ * disk bound work.  It's the same idea as eatmydata, without relying
+ * on LD_PRELOAD.  Files opened with O_SYNC/O_DSYNC are not affected.
+ */
+void
+setup_seccomp_nosync (void)
+{
+  scmp_filter_ctx seccomp;
+  int syscall_nosync[] = {
+    SCMP_SYS(fsync),
+    SCMP_SYS(fdatasync),
+    SCMP_SYS(sync),
+    SCMP_SYS(syncfs),
+    SCMP_SYS(sync_file_range),
+    /* What arm and ppc have instead, with the arguments reordered */
+    SCMP_SYS(sync_file_range2),
+  };
+  int i, r;
+
+  seccomp = seccomp_init(SCMP_ACT_ALLOW);
+  if (!seccomp)
+    return die_oom ();
+
+  add_secondary_archs (seccomp);
+
+  /* An errno of 0 means the call returns 0 */
+  for (i = 0; i < N_ELEMENTS (syscall_nosync); i++)
+    {
+      r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(0), syscall_nosync[i], 0);
+      if (r < 0 && r == -EFAULT /* unknown syscall */)
+        die_with_error ("Failed to stub syscall %d", syscall_nosync[i]);
+    }
+
+  r = seccomp_load (seccomp);
+  if (r < 0)
+    die_with_error ("Failed to install seccomp nosync filter: ");
+
+  seccomp_release (seccomp);
+}
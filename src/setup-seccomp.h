@@ -22,3 +22,4 @@
 #pragma once
 
 void setup_seccomp_v0 (void);
+void setup_seccomp_nosync (void);